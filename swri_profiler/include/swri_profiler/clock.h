@@ -0,0 +1,143 @@
+#ifndef SWRI_PROFILER_CLOCK_H_
+#define SWRI_PROFILER_CLOCK_H_
+
+#include <atomic>
+#include <string>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <ros/time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define SWRI_PROFILER_HAVE_TSC
+#endif
+
+namespace swri_profiler
+{
+// Clock provides the timestamps used by the profiler's recording
+// path.  Timestamps are raw ticks of the selected source, which keeps
+// reading the clock as cheap as possible.  Ticks are only converted
+// to nanoseconds or wall time when the data is published.
+//
+// The source should be selected before the profiler records
+// anything, because ticks from different sources can't be compared.
+// The profiler selects the source from the ~profiler/clock parameter
+// when it initializes unless setSource() was called first.
+class Clock
+{
+ public:
+  enum Source
+  {
+    // ros::WallTime::now(), the profiler's original clock.
+    WALL = 0,
+    // clock_gettime(CLOCK_MONOTONIC_RAW), which is immune to NTP
+    // adjustments.
+    MONOTONIC_RAW,
+    // The CPU's time stamp counter, calibrated against the system
+    // clock.  Only available on x86 processors with an invariant TSC.
+    TSC,
+    // A deterministic clock that only changes when it is set
+    // explicitly.  Intended for tests.
+    FAKE
+  };
+
+  static int64_t now()
+  {
+    switch (source_.load(std::memory_order_relaxed)) {
+    case MONOTONIC_RAW:
+    {
+      timespec ts;
+      clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+      return static_cast<int64_t>(ts.tv_sec)*1000000000 + ts.tv_nsec;
+    }
+#ifdef SWRI_PROFILER_HAVE_TSC
+    case TSC:
+      return static_cast<int64_t>(__rdtsc());
+#endif
+    case FAKE:
+      return fake_now_.load(std::memory_order_relaxed);
+    default:
+      return static_cast<int64_t>(ros::WallTime::now().toNSec());
+    }
+  }
+
+  // Converts a duration in ticks to nanoseconds.
+  static int64_t toNanoseconds(int64_t ticks)
+  {
+    if (ns_per_tick_ == 1.0) {
+      return ticks;
+    }
+    return static_cast<int64_t>(ticks * ns_per_tick_);
+  }
+
+  // Converts a timestamp in ticks to wall time.
+  static ros::WallTime toWallTime(int64_t ticks)
+  {
+    ros::WallTime stamp;
+    stamp.fromNSec(anchor_wall_ns_ + toNanoseconds(ticks - anchor_ticks_));
+    return stamp;
+  }
+
+  // Selects the clock source.  If the source is not usable on this
+  // machine, the wall clock is used instead and false is returned.
+  static bool setSource(Source source);
+  static Source source() { return static_cast<Source>(source_.load()); }
+  static bool isConfigured() { return configured_; }
+
+  static const char* sourceName(Source source);
+  static bool sourceFromName(const std::string &name, Source &source);
+
+  // The sources of per-thread CPU time.  CPU time is measured in
+  // addition to wall time when a source other than CPU_OFF is
+  // selected.
+  enum CpuSource
+  {
+    CPU_OFF = 0,
+    // clock_gettime(CLOCK_THREAD_CPUTIME_ID).
+    CPU_THREAD,
+    // getrusage(RUSAGE_THREAD), which may only be accurate to the
+    // kernel's accounting tick.
+    CPU_RUSAGE
+  };
+
+  // Returns the CPU time used by the calling thread in nanoseconds.
+  static int64_t cpuNow()
+  {
+    if (cpu_source_.load(std::memory_order_relaxed) == CPU_RUSAGE) {
+      rusage usage;
+      getrusage(RUSAGE_THREAD, &usage);
+      return (static_cast<int64_t>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)*1000000 +
+              usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+    }
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<int64_t>(ts.tv_sec)*1000000000 + ts.tv_nsec;
+  }
+
+  static void setCpuSource(CpuSource source) { cpu_source_.store(source); }
+  static CpuSource cpuSource() { return static_cast<CpuSource>(cpu_source_.load(std::memory_order_relaxed)); }
+  static const char* cpuSourceName(CpuSource source);
+  static bool cpuSourceFromName(const std::string &name, CpuSource &source);
+
+  // Controls the FAKE clock source.  Times are in nanoseconds.
+  static void setFakeTime(int64_t ns) { fake_now_.store(ns); }
+  static void advanceFakeTime(int64_t ns) { fake_now_.fetch_add(ns); }
+
+ private:
+  static std::atomic<int> source_;
+  static std::atomic<int> cpu_source_;
+  static std::atomic<int64_t> fake_now_;
+  static bool configured_;
+
+  // The conversion from ticks to nanoseconds, and a pair of
+  // simultaneous tick and wall clock readings used to convert
+  // timestamps to wall time.
+  static double ns_per_tick_;
+  static int64_t anchor_ticks_;
+  static int64_t anchor_wall_ns_;
+
+  static bool calibrateTsc();
+};
+}  // namespace swri_profiler
+#endif  // SWRI_PROFILER_CLOCK_H_
@@ -0,0 +1,103 @@
+#ifndef SWRI_PROFILER_HISTOGRAM_H_
+#define SWRI_PROFILER_HISTOGRAM_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace swri_profiler
+{
+// LatencyHistogram is a fixed size log-linear histogram of durations,
+// similar to an HDR histogram.  Each power of two is split into
+// sub_buckets_ linear buckets, so a recorded value is known to within
+// 1/sub_buckets_ of its magnitude no matter how large it is.  Values
+// are recorded in whatever unit the caller uses (Clock ticks in the
+// profiler) and anything beyond the largest bucket is counted in the
+// last one.
+class LatencyHistogram
+{
+ public:
+  static const int sub_bucket_bits_ = 3;
+  static const int sub_buckets_ = 1 << sub_bucket_bits_;
+  // Covers values up to 2^40, which is several minutes of TSC ticks.
+  static const int max_exponent_ = 40;
+  static const int num_buckets_ = (max_exponent_ - sub_bucket_bits_ + 1) * sub_buckets_;
+
+ private:
+  uint32_t counts_[num_buckets_];
+  uint64_t total_count_;
+
+ public:
+  LatencyHistogram() { clear(); }
+
+  void clear()
+  {
+    std::memset(counts_, 0, sizeof(counts_));
+    total_count_ = 0;
+  }
+
+  void record(int64_t value)
+  {
+    counts_[bucketIndex(value)]++;
+    total_count_++;
+  }
+
+  void merge(const LatencyHistogram &other)
+  {
+    for (int i = 0; i < num_buckets_; i++) {
+      counts_[i] += other.counts_[i];
+    }
+    total_count_ += other.total_count_;
+  }
+
+  uint64_t totalCount() const { return total_count_; }
+
+  // Returns an estimate of the value below which the fraction q of
+  // the recorded values fall.  The estimate is the midpoint of the
+  // bucket containing the quantile.
+  int64_t quantile(double q) const
+  {
+    if (total_count_ == 0) {
+      return 0;
+    }
+
+    const uint64_t rank = std::max<uint64_t>(
+      1, static_cast<uint64_t>(std::ceil(q * total_count_)));
+    uint64_t cumulative = 0;
+    for (int i = 0; i < num_buckets_; i++) {
+      cumulative += counts_[i];
+      if (cumulative >= rank) {
+        return (bucketLowerBound(i) + bucketLowerBound(i+1) - 1) / 2;
+      }
+    }
+    return bucketLowerBound(num_buckets_ - 1);
+  }
+
+  static int bucketIndex(int64_t value)
+  {
+    if (value < sub_buckets_) {
+      return value < 0 ? 0 : static_cast<int>(value);
+    }
+
+    const int exponent = 63 - __builtin_clzll(static_cast<uint64_t>(value));
+    if (exponent >= max_exponent_) {
+      return num_buckets_ - 1;
+    }
+    const int sub_bucket = (value >> (exponent - sub_bucket_bits_)) & (sub_buckets_ - 1);
+    return (exponent - sub_bucket_bits_ + 1) * sub_buckets_ + sub_bucket;
+  }
+
+  static int64_t bucketLowerBound(int index)
+  {
+    if (index < sub_buckets_) {
+      return index;
+    }
+
+    const int exponent = index / sub_buckets_ + sub_bucket_bits_ - 1;
+    const int64_t sub_bucket = index % sub_buckets_;
+    return (sub_buckets_ + sub_bucket) << (exponent - sub_bucket_bits_);
+  }
+};
+}  // namespace swri_profiler
+#endif  // SWRI_PROFILER_HISTOGRAM_H_
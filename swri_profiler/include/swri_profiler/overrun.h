@@ -0,0 +1,76 @@
+#ifndef SWRI_PROFILER_OVERRUN_H_
+#define SWRI_PROFILER_OVERRUN_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace swri_profiler
+{
+// Overrun records a call that took longer than its label's budget
+// (see Profiler::setBudget()).  Times are in Clock ticks and
+// durations in nanoseconds.
+struct Overrun
+{
+  int64_t time;
+  int64_t duration_ns;
+  int64_t budget_ns;
+  size_t node;
+  uint32_t thread_id;
+};
+
+// OverrunBuffer is a small ring of overruns with a single writer (the
+// thread that owns it) and a single reader (the thread that publishes
+// overruns), like TraceBuffer.  Overruns are rare unless something is
+// badly wrong, in which case the rate limit drops most of them
+// anyway, so the ring is small and is part of the thread's storage.
+class OverrunBuffer
+{
+ public:
+  static const size_t capacity_ = 32;
+
+ private:
+  Overrun overruns_[capacity_];
+
+  alignas(64) std::atomic<uint64_t> head_;
+  alignas(64) std::atomic<uint64_t> tail_;
+  std::atomic<uint64_t> dropped_;
+
+ public:
+  OverrunBuffer() : head_(0), tail_(0), dropped_(0) {}
+
+  // Appends an overrun.  Returns false if it was dropped because the
+  // buffer is full.
+  bool push(const Overrun &overrun)
+  {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) >= capacity_) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    overruns_[head % capacity_] = overrun;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Moves every overrun that has been pushed so far to the end of
+  // out.  Only the reader may call this.
+  void drain(std::vector<Overrun> &out)
+  {
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    for (uint64_t i = tail; i != head; i++) {
+      out.push_back(overruns_[i % capacity_]);
+    }
+    tail_.store(head, std::memory_order_release);
+  }
+
+  // Returns the number of overruns dropped since the last call.
+  uint64_t takeDropped()
+  {
+    return dropped_.exchange(0, std::memory_order_relaxed);
+  }
+};
+}  // namespace swri_profiler
+#endif  // SWRI_PROFILER_OVERRUN_H_
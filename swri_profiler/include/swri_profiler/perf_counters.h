@@ -0,0 +1,85 @@
+#ifndef SWRI_PROFILER_PERF_COUNTERS_H_
+#define SWRI_PROFILER_PERF_COUNTERS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace swri_profiler
+{
+// PerfCounters is a group of Linux perf event counters for the
+// calling thread.  The events are chosen once for the whole process
+// by configure(), and then every thread that profiles blocks opens
+// its own group.  All of a group's counters are read with a single
+// read() system call.
+class PerfCounters
+{
+ public:
+  static const size_t max_counters_ = 4;
+
+  struct Values
+  {
+    uint64_t counts[max_counters_];
+  };
+
+  enum Mode
+  {
+    OFF = 0,
+    // Counts instructions and cache misses if the CPU's performance
+    // counters are available, which they often aren't in containers
+    // and VMs, and context switches and page faults.
+    AUTO,
+    // Only counts software events: task clock, context switches and
+    // page faults.
+    SOFTWARE
+  };
+
+  // Chooses the events to count.  This probes which events the
+  // kernel lets us open and falls back to software events if the
+  // hardware counters are unavailable.  Returns false if no events
+  // could be opened, in which case counting stays disabled.  This
+  // must be called before any block is profiled.
+  static bool configure(Mode mode);
+  static bool isEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  // The names of the counted events, in the order of
+  // Values::counts.
+  static const std::vector<std::string>& names() { return names_; }
+  static size_t size() { return events_.size(); }
+
+  static const char* modeName(Mode mode);
+  static bool modeFromName(const std::string &name, Mode &mode);
+
+  // Opens the configured events for the calling thread.
+  PerfCounters();
+  ~PerfCounters();
+
+  bool isValid() const { return group_fd_ >= 0; }
+
+  // Reads the current counts.  Returns false if the read failed.
+  bool read(Values &values) const;
+
+ private:
+  struct Event
+  {
+    uint32_t type;
+    uint64_t config;
+    bool exclude_kernel;
+    std::string name;
+  };
+
+  static std::atomic<bool> enabled_;
+  static std::vector<Event> events_;
+  static std::vector<std::string> names_;
+
+  static int openEvent(const Event &event, int group_fd);
+
+  int group_fd_;
+  std::vector<int> fds_;
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+};
+}  // namespace swri_profiler
+#endif  // SWRI_PROFILER_PERF_COUNTERS_H_
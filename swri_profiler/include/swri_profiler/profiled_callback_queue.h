@@ -0,0 +1,111 @@
+#ifndef SWRI_PROFILER_PROFILED_CALLBACK_QUEUE_H_
+#define SWRI_PROFILER_PROFILED_CALLBACK_QUEUE_H_
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <typeindex>
+#include <unordered_map>
+#include <utility>
+
+#include <ros/callback_queue.h>
+#include <ros/node_handle.h>
+#include <ros/subscribe_options.h>
+
+#include <swri_profiler/profiler.h>
+
+namespace swri_profiler
+{
+// ProfiledCallbackQueue is a ros::CallbackQueue that profiles every
+// callback it calls, so that a node's subscription, timer and service
+// callbacks show up in the profiler without adding SWRI_PROFILE to
+// each of them.  Use it instead of the global queue by setting it on
+// the node's NodeHandles and spinning it:
+//
+//   swri_profiler::ProfiledCallbackQueue queue;
+//   ros::NodeHandle nh;
+//   nh.setCallbackQueue(&queue);
+//   ...
+//   ros::SingleThreadedSpinner spinner;
+//   spinner.spin(&queue);
+//
+// Each callback is recorded as a block named after its type
+// ("subscription-callback", "timer-callback" or "service-callback";
+// roscpp doesn't tell the queue which topic or timer a callback
+// belongs to), so blocks profiled inside the callback are nested
+// under it.  The time from when the callback was queued, e.g. when
+// its message arrived, to when it was first called is recorded
+// alongside it as "<name>.queue-wait".
+//
+// To tell subscriptions or timers apart, give them a named view of
+// the queue instead, or subscribe through the queue to name a
+// subscription after its topic:
+//
+//   ros::Timer timer = nh.createTimer(
+//     ros::TimerOptions(ros::Duration(0.1), callback, queue.named("control-loop")));
+//   ros::Subscriber sub = queue.subscribe(nh, options);
+class ProfiledCallbackQueue : public ros::CallbackQueue
+{
+ public:
+  explicit ProfiledCallbackQueue(bool enabled = true);
+
+  virtual void addCallback(const ros::CallbackInterfacePtr &callback,
+                           uint64_t removal_id = 0);
+
+  // Returns a queue that adds its callbacks to this one, recorded as
+  // "<name>" instead of by type.  Slashes in the name are replaced
+  // with underscores.  The view is owned by this queue, and asking
+  // for the same name again returns the same view.
+  ros::CallbackQueueInterface* named(const std::string &name);
+
+  // Subscribes like nh.subscribe(options) with options.callback_queue
+  // set to a view named after the resolved topic, e.g. "robot_scan"
+  // for "/robot/scan".
+  ros::Subscriber subscribe(ros::NodeHandle &nh, ros::SubscribeOptions options);
+
+ private:
+  // The callback and queue wait labels of each type of callback.
+  typedef std::pair<const Label*, const Label*> Labels;
+  std::mutex labels_mutex_;
+  std::unordered_map<std::type_index, Labels> labels_;
+
+  // Passes callbacks on to the queue with the name they should be
+  // recorded as.
+  class NamedQueue : public ros::CallbackQueueInterface
+  {
+    ProfiledCallbackQueue &queue_;
+    const std::string name_;
+
+   public:
+    NamedQueue(ProfiledCallbackQueue &queue, const std::string &name)
+      :
+      queue_(queue),
+      name_(name)
+    {
+    }
+
+    virtual void addCallback(const ros::CallbackInterfacePtr &callback,
+                             uint64_t removal_id = 0)
+    {
+      queue_.addProfiledCallback(callback, removal_id, &name_);
+    }
+
+    virtual void removeByID(uint64_t removal_id)
+    {
+      queue_.removeByID(removal_id);
+    }
+  };
+
+  // The named views and the labels of each name, guarded by
+  // labels_mutex_.
+  std::unordered_map<std::string, std::unique_ptr<NamedQueue> > named_queues_;
+  std::unordered_map<std::string, Labels> named_labels_;
+
+  void addProfiledCallback(const ros::CallbackInterfacePtr &callback,
+                           uint64_t removal_id,
+                           const std::string *name);
+  Labels labelsFor(const ros::CallbackInterface &callback);
+  Labels labelsNamed(const std::string &name);
+};
+}  // namespace swri_profiler
+#endif  // SWRI_PROFILER_PROFILED_CALLBACK_QUEUE_H_
@@ -0,0 +1,263 @@
+#ifndef SWRI_PROFILER_PROFILED_MUTEX_H_
+#define SWRI_PROFILER_PROFILED_MUTEX_H_
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/shared_mutex.hpp>
+
+#include <swri_profiler/profiler.h>
+
+namespace swri_profiler
+{
+// ProfiledMutex wraps a mutex to show lock contention in the
+// profiler.  It can be used anywhere the underlying mutex can,
+// e.g. with std::lock_guard.  Each acquisition that has to wait
+// records a "<name>.wait" block, and each release records a
+// "<name>.hold" block for the time the lock was held.  Both are
+// nested in the calling thread's innermost open block, so a slow
+// block that is really waiting on a lock shows it in the call tree.
+// The wait block's call count is the number of contended
+// acquisitions, and the hold block's is the number of all of them.
+template<typename Mutex = std::mutex>
+class ProfiledMutex
+{
+ public:
+  explicit ProfiledMutex(const std::string &name)
+    :
+    name_(name),
+    wait_label_(nullptr),
+    hold_label_(nullptr),
+    locked_at_(0),
+    profiled_(false)
+  {
+  }
+
+  void lock()
+  {
+    if (!Profiler::isEnabled()) {
+      mutex_.lock();
+      profiled_ = false;
+      return;
+    }
+
+    resolveLabels();
+    if (!mutex_.try_lock()) {
+      const int64_t t0 = Clock::now();
+      mutex_.lock();
+      Profiler::recordBlock(*wait_label_.load(std::memory_order_acquire), t0);
+    }
+    locked_at_ = Clock::now();
+    profiled_ = true;
+  }
+
+  bool try_lock()
+  {
+    if (!mutex_.try_lock()) {
+      return false;
+    }
+    profiled_ = Profiler::isEnabled();
+    if (profiled_) {
+      resolveLabels();
+      locked_at_ = Clock::now();
+    }
+    return true;
+  }
+
+  void unlock()
+  {
+    // Only the owner touches locked_at_ and profiled_, so they must be
+    // read before the lock is released.
+    const int64_t t0 = locked_at_;
+    const bool profiled = profiled_;
+    mutex_.unlock();
+    if (profiled) {
+      Profiler::recordBlock(*hold_label_.load(std::memory_order_acquire), t0);
+    }
+  }
+
+  Mutex& native() { return mutex_; }
+
+ private:
+  Mutex mutex_;
+  const std::string name_;
+
+  // The labels are looked up the first time the lock is used, rather
+  // than when it is constructed, because looking them up initializes
+  // the profiler, which can't happen before ros::init().
+  std::atomic<const Label*> wait_label_;
+  std::atomic<const Label*> hold_label_;
+
+  // When the current owner acquired the lock, in Clock ticks, and
+  // whether the acquisition was profiled.  Any tick count is a valid
+  // time, e.g. zero with the fake clock, so it can't mark an
+  // unprofiled acquisition itself.
+  int64_t locked_at_;
+  bool profiled_;
+
+  void resolveLabels()
+  {
+    if (hold_label_.load(std::memory_order_acquire)) {
+      return;
+    }
+    wait_label_.store(Profiler::lookupLabel(name_ + ".wait"), std::memory_order_release);
+    hold_label_.store(Profiler::lookupLabel(name_ + ".hold"), std::memory_order_release);
+  }
+
+  ProfiledMutex(const ProfiledMutex&) = delete;
+  ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+};
+
+// ProfiledSharedMutex is the shared mutex version of ProfiledMutex.
+// Exclusive locks are recorded like ProfiledMutex's, and shared locks
+// as "<name>.shared-wait" and "<name>.shared-hold".  A shared lock
+// must be released by the thread that acquired it.
+template<typename SharedMutex = boost::shared_mutex>
+class ProfiledSharedMutex
+{
+ public:
+  explicit ProfiledSharedMutex(const std::string &name)
+    :
+    name_(name),
+    wait_label_(nullptr),
+    hold_label_(nullptr),
+    shared_wait_label_(nullptr),
+    shared_hold_label_(nullptr),
+    locked_at_(0),
+    profiled_(false)
+  {
+  }
+
+  void lock()
+  {
+    if (!Profiler::isEnabled()) {
+      mutex_.lock();
+      profiled_ = false;
+      return;
+    }
+
+    resolveLabels();
+    if (!mutex_.try_lock()) {
+      const int64_t t0 = Clock::now();
+      mutex_.lock();
+      Profiler::recordBlock(*wait_label_.load(std::memory_order_acquire), t0);
+    }
+    locked_at_ = Clock::now();
+    profiled_ = true;
+  }
+
+  bool try_lock()
+  {
+    if (!mutex_.try_lock()) {
+      return false;
+    }
+    profiled_ = Profiler::isEnabled();
+    if (profiled_) {
+      resolveLabels();
+      locked_at_ = Clock::now();
+    }
+    return true;
+  }
+
+  void unlock()
+  {
+    const int64_t t0 = locked_at_;
+    const bool profiled = profiled_;
+    mutex_.unlock();
+    if (profiled) {
+      Profiler::recordBlock(*hold_label_.load(std::memory_order_acquire), t0);
+    }
+  }
+
+  void lock_shared()
+  {
+    if (!Profiler::isEnabled()) {
+      mutex_.lock_shared();
+      return;
+    }
+
+    resolveLabels();
+    if (!mutex_.try_lock_shared()) {
+      const int64_t t0 = Clock::now();
+      mutex_.lock_shared();
+      Profiler::recordBlock(*shared_wait_label_.load(std::memory_order_acquire), t0);
+    }
+    sharedLocks().push_back(std::make_pair(this, Clock::now()));
+  }
+
+  bool try_lock_shared()
+  {
+    if (!mutex_.try_lock_shared()) {
+      return false;
+    }
+    if (Profiler::isEnabled()) {
+      resolveLabels();
+      sharedLocks().push_back(std::make_pair(this, Clock::now()));
+    }
+    return true;
+  }
+
+  void unlock_shared()
+  {
+    mutex_.unlock_shared();
+
+    // Several threads can hold the lock at once, so each thread keeps
+    // its own acquisition times.
+    std::vector<SharedLock> &locks = sharedLocks();
+    for (auto it = locks.rbegin(); it != locks.rend(); ++it) {
+      if (it->first == this) {
+        const int64_t t0 = it->second;
+        locks.erase(std::next(it).base());
+        Profiler::recordBlock(*shared_hold_label_.load(std::memory_order_acquire), t0);
+        break;
+      }
+    }
+  }
+
+  SharedMutex& native() { return mutex_; }
+
+ private:
+  SharedMutex mutex_;
+  const std::string name_;
+
+  std::atomic<const Label*> wait_label_;
+  std::atomic<const Label*> hold_label_;
+  std::atomic<const Label*> shared_wait_label_;
+  std::atomic<const Label*> shared_hold_label_;
+
+  // When the current exclusive owner acquired the lock, in Clock
+  // ticks, and whether the acquisition was profiled.
+  int64_t locked_at_;
+  bool profiled_;
+
+  // The shared locks held by the calling thread and when they were
+  // acquired.
+  typedef std::pair<const void*, int64_t> SharedLock;
+  static std::vector<SharedLock>& sharedLocks()
+  {
+    static thread_local std::vector<SharedLock> locks;
+    return locks;
+  }
+
+  void resolveLabels()
+  {
+    if (shared_hold_label_.load(std::memory_order_acquire)) {
+      return;
+    }
+    wait_label_.store(Profiler::lookupLabel(name_ + ".wait"), std::memory_order_release);
+    hold_label_.store(Profiler::lookupLabel(name_ + ".hold"), std::memory_order_release);
+    shared_wait_label_.store(Profiler::lookupLabel(name_ + ".shared-wait"),
+                             std::memory_order_release);
+    shared_hold_label_.store(Profiler::lookupLabel(name_ + ".shared-hold"),
+                             std::memory_order_release);
+  }
+
+  ProfiledSharedMutex(const ProfiledSharedMutex&) = delete;
+  ProfiledSharedMutex& operator=(const ProfiledSharedMutex&) = delete;
+};
+}  // namespace swri_profiler
+#endif  // SWRI_PROFILER_PROFILED_MUTEX_H_
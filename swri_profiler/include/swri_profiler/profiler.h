@@ -5,11 +5,21 @@
 #include <limits>
 #include <unordered_map>
 #include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <ros/time.h>
 #include <ros/console.h>
 #include <diagnostic_updater/diagnostic_updater.h>
 
+#include <swri_profiler/clock.h>
+#include <swri_profiler/histogram.h>
+#include <swri_profiler/overrun.h>
+#include <swri_profiler/perf_counters.h>
+#include <swri_profiler/trace.h>
+
 namespace swri_profiler
 {
 class SpinLock
@@ -20,7 +30,15 @@ class SpinLock
     
   void acquire()
   { 
-    while (locked_.test_and_set(std::memory_order_acquire)) { ; }
+    // Spin briefly before yielding so that a preempted holder does
+    // not leave the waiter burning its whole time slice.
+    size_t spins = 0;
+    while (locked_.test_and_set(std::memory_order_acquire)) {
+      if (++spins >= 64) {
+        std::this_thread::yield();
+        spins = 0;
+      }
+    }
   }
 
   void release()
@@ -38,172 +56,1223 @@ class SpinLockGuard
   ~SpinLockGuard() { lock_.release(); }
 };
 
+// Label is an interned profiler label.  Labels are registered once
+// and never released, so the recording path can hold on to them by
+// pointer and refer to them by their small integer id.
+struct Label
+{
+  size_t id;
+  std::string name;
+
+  // If non-zero, only one in sampling_period calls to blocks with
+  // this label are timed, overriding the period requested at the
+  // call site.  See Profiler::setSamplingPeriod().
+  mutable std::atomic<uint32_t> sampling_period;
+
+  // Blocks with disabled labels are not recorded.  See
+  // Profiler::setLabelsEnabled().
+  mutable std::atomic<bool> enabled;
+
+  // Calls that take longer than budget_ns are published as overruns.
+  // Zero means that no budget has been set, and a negative value that
+  // the label explicitly has none.  See Profiler::setBudget().
+  mutable std::atomic<int64_t> budget_ns;
+
+  Label() : id(0), sampling_period(0), enabled(true), budget_ns(0) {}
+};
+
+class LabelSite;
+class AsyncSpan;
+
 class Profiler
 {
+  // The report_time of an unused stack frame (see OpenInfo).
+  static const int64_t closed_report_time_ = std::numeric_limits<int64_t>::min();
+
+  // The most exemplars that are kept per block per window (see
+  // exemplars_per_block_).
+  static const size_t max_exemplars_ = 4;
+
+  // Exemplar records one of the slowest calls to a block.  Times are
+  // in Clock ticks.  The block's call tree node gives the stack that
+  // was open when it ran.
+  struct Exemplar
+  {
+    int64_t t0;
+    int64_t duration;
+    uint32_t thread_id;
+
+    // Orders a heap of exemplars with the fastest one on top, so it is
+    // the one replaced by a slower call.
+    static bool faster(const Exemplar &a, const Exemplar &b) { return a.duration > b.duration; }
+  };
+
   // OpenInfo stores data for profiled blocks that are currently
-  // executing.
+  // executing.  Times are in Clock ticks.
   struct OpenInfo
   {
-    ros::WallTime t0;
-    ros::WallTime last_report_time;
-    OpenInfo() : last_report_time(0) {}
+    size_t node;
+    // False if the block was skipped by sampling.  Untimed blocks are
+    // still pushed on the stack so that their children land in the
+    // right place in the call tree, but they never read the clock.
+    bool timed;
+    // True if the block's begin event was written to the trace, in
+    // which case its end event must be written too.
+    bool traced;
+    // True if the thread's CPU time was read when the block opened,
+    // in which case cpu0 holds it in nanoseconds.
+    bool cpu_timed;
+    // True if the thread's perf counters were read when the block
+    // opened, in which case TLS::perf_start holds them.
+    bool perf_timed;
+    int64_t t0;
+    int64_t cpu0;
+
+    // report_time is shared with the publisher, which reads the open
+    // blocks without locking (see collectAndPublish()).  It is
+    // closed_report_time_ while the frame is unused, a negative tag
+    // that is unique to the call while the call hasn't been reported,
+    // and the time of the last report after that.  Untimed calls keep
+    // their tag, since they have nothing to report, but publishing it
+    // lets the publisher see that their node is still in use.  The publisher
+    // claims each report with a compare-and-swap from the value it
+    // read, and close() exchanges it for closed_report_time_, so each
+    // part of a call's duration is counted exactly once, and a frame
+    // that was closed or reused while the publisher read it is
+    // skipped.
+    std::atomic<int64_t> report_time;
+    OpenInfo()
+      : node(0), timed(true), traced(false), cpu_timed(false), perf_timed(false),
+        t0(0), cpu0(0), report_time(closed_report_time_)
+    {}
   };
 
   // ClosedInfo stores data for profiled blocks that have finished
-  // executing.
+  // executing.  Durations are in Clock ticks.
   struct ClosedInfo
   {
+    // count is the number of timed calls and untimed_count is the
+    // number of calls that were skipped by sampling.
     size_t count;
-    ros::WallDuration total_duration;
-    ros::WallDuration rel_duration;
-    ros::WallDuration max_duration;  
-    ClosedInfo() : count(0) {}
+    size_t untimed_count;
+    int64_t total_duration;
+    int64_t rel_duration;
+    int64_t max_duration;  
+
+    // Heap allocations made by the calls, including nested blocks.
+    // These are only counted when the allocation hooks are installed
+    // (see countAllocation()).
+    uint64_t alloc_count;
+    uint64_t alloc_bytes;
+    uint64_t free_count;
+
+    // The work done by the calls, as reported by addItems() and
+    // addBytes().
+    uint64_t items;
+    uint64_t bytes;
+
+    // The CPU time used by the calls whose CPU time was measured (see
+    // Clock::cpuNow()), in nanoseconds, and the number of those calls.
+    size_t cpu_count;
+    int64_t cpu_duration;
+
+    // The perf counter deltas of the calls whose counters were read,
+    // in the order of PerfCounters::names(), and the number of those
+    // calls.
+    size_t perf_count;
+    uint64_t perf_counts[PerfCounters::max_counters_];
+
+    // The distribution of durations.  It is allocated the first time
+    // the block closes and is kept when the info is reset, so a
+    // block only allocates once per table.
+    std::unique_ptr<LatencyHistogram> histogram;
+
+    // The slowest timed calls, kept as a heap with the fastest of them
+    // first.
+    size_t exemplar_count;
+    Exemplar exemplars[max_exemplars_];
+
+    ClosedInfo()
+      : count(0), untimed_count(0), total_duration(0), rel_duration(0), max_duration(0),
+        alloc_count(0), alloc_bytes(0), free_count(0), items(0), bytes(0), cpu_count(0),
+        cpu_duration(0), perf_count(0), perf_counts(), exemplar_count(0), exemplars()
+    {}
+
+    // Keeps exemplar if it is one of the limit slowest calls seen.
+    // This only touches the heap when the call is slower than the
+    // fastest exemplar, which is rare once the window has a few calls.
+    void addExemplar(const Exemplar &exemplar, size_t limit)
+    {
+      if (exemplar_count < limit) {
+        exemplars[exemplar_count++] = exemplar;
+        std::push_heap(exemplars, exemplars + exemplar_count, Exemplar::faster);
+      } else if (exemplar_count > 0 && exemplar.duration > exemplars[0].duration) {
+        std::pop_heap(exemplars, exemplars + exemplar_count, Exemplar::faster);
+        exemplars[exemplar_count-1] = exemplar;
+        std::push_heap(exemplars, exemplars + exemplar_count, Exemplar::faster);
+      }
+    }
+
+    void reset()
+    {
+      count = 0;
+      untimed_count = 0;
+      total_duration = 0;
+      rel_duration = 0;
+      max_duration = 0;
+      alloc_count = 0;
+      alloc_bytes = 0;
+      free_count = 0;
+      items = 0;
+      bytes = 0;
+      cpu_count = 0;
+      cpu_duration = 0;
+      perf_count = 0;
+      std::fill(perf_counts, perf_counts + PerfCounters::max_counters_, 0);
+      exemplar_count = 0;
+      if (histogram) {
+        histogram->clear();
+      }
+    }
   };
 
-  // Thread local storage for the profiler.
-  struct TLS
+  // ClosedTable stores the closed blocks recorded by one thread
+  // during one publishing interval.  blocks is indexed by call tree
+  // node id, and touched lists the nodes that have a non-zero count
+  // so that harvesting the table doesn't have to scan every node.
+  struct ClosedTable
+  {
+    std::vector<ClosedInfo> blocks;
+    std::vector<size_t> touched;
+  };
+
+  // AllocCounts accumulates the heap allocations made while a stack
+  // frame is the innermost open block.
+  struct AllocCounts
+  {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t frees;
+    AllocCounts() : count(0), bytes(0), frees(0) {}
+  };
+
+  // WorkCounts accumulates the work reported while a stack frame is
+  // the innermost open block.
+  struct WorkCounts
+  {
+    uint64_t items;
+    uint64_t bytes;
+    WorkCounts() : items(0), bytes(0) {}
+  };
+
+  // ChildCache remembers the most recent child opened from a stack
+  // frame.  Loops usually open the same child over and over, so this
+  // saves most of the hash lookups in childNode().  Different blocks
+  // open at the same depth over time, so the cache is keyed on the
+  // parent node as well as the label.
+  struct ChildCache
+  {
+    size_t parent;
+    size_t label_id;
+    size_t node;
+    ChildCache()
+      :
+      parent(std::numeric_limits<size_t>::max()),
+      label_id(std::numeric_limits<size_t>::max()),
+      node(0)
+    {}
+  };
+
+  // Thread local storage for the profiler.  Each thread records into
+  // its own TLS so that worker threads never contend with each
+  // other.  The publishing thread reaches every TLS through
+  // all_tls_.  The structure is aligned to a cache line (see
+  // initializeTLS) so that neighboring threads' tables never share
+  // one.
+  struct alignas(64) TLS
   {
     // We support multiple threads by tracking the call stack
     // independently per thread.  We also track the stack depth to
-    // guard against problems from recursion.
+    // guard against problems from recursion.  The stack is stored as
+    // call tree node ids in open_blocks.  open_blocks[0] is the root
+    // of the call tree and is never reported.
     size_t stack_depth;
-    std::string stack_str;
-    std::string thread_prefix;
+
+    // labels caches the labels that this thread has looked up by
+    // name so that dynamic labels don't touch the shared label table
+    // after their first use.
+    std::unordered_map<std::string, const Label*> labels;
+
+    // children caches the call tree edges that this thread has used,
+    // keyed by (parent node << 32 | label id), so that opening a
+    // block only touches the shared call tree the first time a
+    // thread sees an edge.  child_cache is indexed by stack depth.
+    std::unordered_map<uint64_t, size_t> children;
+    std::vector<ChildCache> child_cache;
+    // The tree_generation_ that the caches were built in.
+    uint32_t tree_generation;
+
+    // Sampling state.  sample_counters is indexed by label id and
+    // counts the calls since the label was last timed.  rng_state is
+    // used instead when random sampling is enabled.
+    std::vector<uint32_t> sample_counters;
+    uint64_t rng_state;
+
+    // Counts the timed calls since the thread's CPU time was last
+    // measured.  See cpu_sampling_period_.
+    uint32_t cpu_counter;
+
+    // epoch is odd while the owning thread is recording into
+    // closed_blocks[active].  The publisher flips active and then
+    // waits for an odd epoch to change before harvesting the old
+    // buffer, so the owning thread never waits on the publisher.
+    std::atomic<uint64_t> epoch;
+    std::atomic<int> active;
+    ClosedTable closed_blocks[2];
+
+    // open_blocks is indexed by stack depth and stores the blocks
+    // that are currently executing on this thread.  It is only
+    // shared with the publisher, which needs the start times to
+    // report blocks that are still running.  The publisher never
+    // blocks the owning thread: it reads frames up to open_high_water,
+    // the deepest frame ever used, and relies on
+    // OpenInfo::report_time to tell which are valid.  open_serial
+    // numbers the calls for the report_time tags.
+    std::unique_ptr<OpenInfo[]> open_blocks;
+    std::atomic<size_t> open_high_water;
+    uint64_t open_serial;
+
+    // allocs is indexed by stack depth like open_blocks, but it is
+    // only ever touched by the owning thread.  Frames above the top
+    // of the stack are always zero.
+    std::vector<AllocCounts> allocs;
+
+    // work is indexed by stack depth like allocs and is also only
+    // touched by the owning thread.
+    std::vector<WorkCounts> work;
+
+    // The thread's trace events, allocated the first time the thread
+    // opens a block while tracing is enabled.  The trace thread
+    // drains it into the trace file.  trace_unavailable is set if the
+    // trace memory budget was exhausted so that we don't retry on
+    // every block.
+    std::atomic<TraceBuffer*> trace;
+    bool trace_unavailable;
+    uint32_t thread_id;
+
+    // The thread's most recent timed blocks, allocated the first time
+    // the thread times a block while the flight recorder is enabled,
+    // and read when a flight recording is dumped.
+    std::atomic<FlightRecorder*> flight;
+    bool flight_unavailable;
+
+    // The thread's perf counters, opened the first time the thread
+    // times a block while perf counters are enabled.  perf_start is
+    // indexed by stack depth and holds the counts read when each
+    // frame opened.  Both are only touched by the owning thread.
+    std::unique_ptr<PerfCounters> perf;
+    std::vector<PerfCounters::Values> perf_start;
+    bool perf_unavailable;
+
+    // Calls that exceeded their budget, waiting to be published by
+    // the overrun thread.
+    OverrunBuffer overruns;
+
+    // Set when the owning thread exits.  The publisher harvests any
+    // remaining data and then releases the storage.
+    std::atomic<bool> retired;
+
+    TLS()
+      : stack_depth(0), tree_generation(0), rng_state(0), cpu_counter(0), epoch(0), active(0),
+        open_high_water(0), open_serial(0), trace(nullptr), trace_unavailable(false), thread_id(0),
+        flight(nullptr), flight_unavailable(false), perf_unavailable(false), retired(false)
+    {}
   };
 
-  // open_blocks_ stores data for profiled blocks that are currently
-  // executing.  It maps a thread_prefix + stack_address to an OpenInfo
-  // block.  This is stored as a shared static variable instead of a
-  // TLS because the publishing thread needs to access it.
-  static std::unordered_map<std::string, OpenInfo> open_blocks_;
+  // The maximum depth of a thread's profiler stack.
+  static const size_t max_stack_depth_ = 100;
 
-  // closed_blocks_ stored data for profiled blocks that have finished
-  // executing.  It maps a stack_address to a ClosedInfo block.  This
-  // map is cleared out regularly.
-  static std::unordered_map<std::string, ClosedInfo> closed_blocks_;
+  // all_tls_ stores the thread local storage of every thread that
+  // has used the profiler so that the publishing thread can collect
+  // their data.
+  static std::vector<TLS*> all_tls_;
 
   // tls_ stores the thread local storage so that the profiler can
   // maintain a separate stack for each thread.
   static boost::thread_specific_ptr<TLS> tls_;
 
-  // This spinlock guards access to open_blocks_ and closed_blocks_.
+  // This spinlock guards access to all_tls_ and the profiler's
+  // initialization.  It is never taken while recording a block.
   static SpinLock lock_;
 
+  // enabled_ is the global on/off switch, checked before anything
+  // else when a block is opened.
+  static std::atomic<bool> enabled_;
+
+  // If true, sampled blocks are timed with a probability of
+  // 1/period instead of on every period'th call.
+  static bool random_sampling_;
+
+  // trace_enabled_ turns on recording of individual trace events in
+  // addition to the aggregated statistics.
+  static std::atomic<bool> trace_enabled_;
+
+  // When CPU time is enabled (see Clock::setCpuSource()), it is only
+  // measured for one in cpu_sampling_period_ timed calls on each
+  // thread, because reading it costs a system call.
+  static uint32_t cpu_sampling_period_;
+
+  // The number of slowest calls published with each block per window
+  // (see the ~profiler/exemplars parameter), at most max_exemplars_.
+  static size_t exemplars_per_block_;
+
+  // The number of events in each thread's flight recorder, or zero if
+  // the flight recorder is disabled.
+  static size_t flight_recorder_events_;
+
+  // Set while the allocation hooks are installed.
+  static std::atomic<bool> count_allocations_;
+
+  // The call tree has a limited number of nodes, and blocks that
+  // don't fit are recorded in an overflow node (see internNode()).
+  // Labels are limited in the same way, and names that don't fit
+  // share overflow_label_.  Threads don't cache either of them, since
+  // they stand in for an unbounded number of names.  The publisher
+  // evicts idle nodes and reuses their ids, and increments
+  // tree_generation_ when it does so that threads drop their cached
+  // node ids.
+  static std::atomic<const Label*> overflow_label_;
+  static std::atomic<uint32_t> tree_generation_;
+
   // Other static methods implemented in profiler.cpp
   static void initializeProfiler();
   static void initializeTLS();
+  static void cleanupTLS(TLS *tls);
   static void profilerMain();
+  static void calibrateOverhead();
   static void collectAndPublish();
+  static void harvestClosedBlocks(ClosedTable &dst, ClosedTable &src);
+  static size_t internNode(size_t parent, size_t label_id, bool &overflow);
+  static void evictIdleNodes(int64_t now_ns, bool &update_index);
+  static bool initializeTrace(TLS &tls);
+  static void traceMain();
+  static void drainTrace(TLS &tls);
+  static void releaseTrace(TLS &tls);
+  static bool initializeFlightRecorder(TLS &tls);
+  static void flightMain();
+  static bool initializePerf(TLS &tls);
+  static void reportOverrun(TLS &tls, size_t node, int64_t time,
+                            int64_t duration_ns, int64_t budget_ns);
+  static void overrunMain();
+  static size_t asyncRoot();
+
+  // Returns the thread's trace buffer, allocating it if necessary, or
+  // NULL if it could not be allocated.
+  static TraceBuffer* traceBuffer(TLS &tls)
+  {
+    TraceBuffer *trace = tls.trace.load(std::memory_order_relaxed);
+    if (!trace && !tls.trace_unavailable && initializeTrace(tls)) {
+      trace = tls.trace.load(std::memory_order_relaxed);
+    }
+    return trace;
+  }
+
+  // Returns the thread's flight recorder, allocating it if necessary,
+  // or NULL if the flight recorder is disabled.
+  static FlightRecorder* flightRecorder(TLS &tls)
+  {
+    FlightRecorder *flight = tls.flight.load(std::memory_order_relaxed);
+    if (!flight && flight_recorder_events_ != 0 && !tls.flight_unavailable &&
+        initializeFlightRecorder(tls)) {
+      flight = tls.flight.load(std::memory_order_relaxed);
+    }
+    return flight;
+  }
 
-  static bool open(const std::string &name, const ros::WallTime &t0)
+  // Reads the thread's perf counters into the perf_start of the stack
+  // frame at depth, opening them if necessary.  Returns false if they
+  // couldn't be read.
+  static bool startPerf(TLS &tls, size_t depth)
+  {
+    if (!tls.perf && (tls.perf_unavailable || !initializePerf(tls))) {
+      return false;
+    }
+    return tls.perf->read(tls.perf_start[depth]);
+  }
+
+  // Returns true if the next call to a block with label should be
+  // timed.
+  static bool sampleNext(TLS &tls, const Label &label, uint32_t period)
+  {
+    const uint32_t label_period = label.sampling_period.load(std::memory_order_relaxed);
+    if (label_period != 0) {
+      period = label_period;
+    }
+    if (period <= 1) {
+      return true;
+    }
+
+    if (random_sampling_) {
+      // xorshift64
+      tls.rng_state ^= tls.rng_state << 13;
+      tls.rng_state ^= tls.rng_state >> 7;
+      tls.rng_state ^= tls.rng_state << 17;
+      return tls.rng_state % period == 0;
+    }
+
+    if (label.id >= tls.sample_counters.size()) {
+      tls.sample_counters.resize(label.id+1, 0);
+    }
+    uint32_t &counter = tls.sample_counters[label.id];
+    if (++counter >= period) {
+      counter = 0;
+      return true;
+    }
+    return false;
+  }
+
+  // Returns true if the thread's CPU time should be measured for the
+  // next timed call.
+  static bool sampleCpu(TLS &tls)
+  {
+    if (Clock::cpuSource() == Clock::CPU_OFF) {
+      return false;
+    }
+    if (++tls.cpu_counter >= cpu_sampling_period_) {
+      tls.cpu_counter = 0;
+      return true;
+    }
+    return false;
+  }
+
+  // Returns the call tree node for label under parent, using the
+  // thread's cache of call tree edges.
+  static size_t lookupChild(TLS &tls, size_t parent, const Label &label)
+  {
+    const uint64_t key = (static_cast<uint64_t>(parent) << 32) | label.id;
+    auto const it = tls.children.find(key);
+    if (it != tls.children.end()) {
+      return it->second;
+    }
+    bool overflow;
+    const size_t node = internNode(parent, label.id, overflow);
+    if (!overflow) {
+      tls.children[key] = node;
+    }
+    return node;
+  }
+
+  // Drops the thread's cached node ids if the publisher has evicted
+  // nodes since they were cached.
+  static void checkTreeGeneration(TLS &tls)
+  {
+    const uint32_t generation = tree_generation_.load(std::memory_order_acquire);
+    if (tls.tree_generation != generation) {
+      tls.children.clear();
+      std::fill(tls.child_cache.begin(), tls.child_cache.end(), ChildCache());
+      tls.tree_generation = generation;
+    }
+  }
+
+  // Returns the call tree node for label opened from the stack frame
+  // at depth.
+  static size_t childNode(TLS &tls, size_t depth, const Label &label)
+  {
+    ChildCache &cache = tls.child_cache[depth];
+    const size_t parent = tls.open_blocks[depth].node;
+    if (cache.label_id != label.id || cache.parent != parent) {
+      cache.node = lookupChild(tls, parent, label);
+      cache.parent = parent;
+      cache.label_id = label.id;
+    }
+    return cache.node;
+  }
+
+ public:
+  // Returns the full path of a call tree node (e.g. /a/b/c).  This
+  // takes a lock and allocates, so it should only be used for
+  // reporting.
+  static std::string nodePath(size_t node);
+
+  // Returns the interned label for name, registering it if
+  // necessary.  This always takes a lock, so prefer lookupLabel() or
+  // a LabelSite on recording paths.
+  static const Label* internLabel(const std::string &name);
+
+  // Only time one in period calls to blocks with this label.  The
+  // call counts stay exact and the published durations are scaled
+  // up from the timed calls.  This overrides the period given to
+  // SWRI_PROFILE_SAMPLED.  A period of zero restores the call site's
+  // period.
+  static void setSamplingPeriod(const std::string &name, uint32_t period);
+
+  // Sets a time budget for blocks with the given label.  Timed calls
+  // that take longer are published on /profiler/overruns as soon as
+  // they close, at a limited rate (see the ~profiler/overrun_rate
+  // parameter).  This overrides any budget given to
+  // SWRI_PROFILE_BUDGET, and a budget of zero or less removes it.
+  // Calls skipped by sampling are not checked.
+  static void setBudget(const std::string &name, double seconds);
+
+  // Turns the profiler on or off at runtime.  While the profiler is
+  // disabled, a profiled block costs a single branch: it doesn't
+  // touch thread local storage or read the clock.  Blocks that were
+  // already open when the profiler was disabled still close normally,
+  // and blocks opened while it was disabled are ignored when it is
+  // re-enabled.
+  static void setEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+  static bool isEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  // Enables or disables every label that starts with prefix,
+  // including labels that are first used later.  When several
+  // prefixes match a label, the longest one wins.  A disabled block is
+  // not recorded, but blocks nested inside it still are, under the
+  // disabled block's parent.
+  static void setLabelsEnabled(const std::string &prefix, bool enabled);
+
+  // Runs the profiler without ROS, for benchmarks and tests that
+  // don't have a ROS master.  This must be called before any block is
+  // opened.  The profiler then reads no parameters and publishes
+  // nothing.  The publishing thread is only started by
+  // setStandalonePublisher(true), and it still collects and formats
+  // the data every period so that its cost can be measured.
+  static void initializeStandalone();
+  static void setStandalonePublisher(bool running);
+  // Collects and formats the data immediately, as the publishing
+  // thread does at the end of every period, and frees the storage of
+  // threads that have exited.  Combined with setSharedMemoryExport(),
+  // this lets tests check exactly what would be published.  It must
+  // not be called while the standalone publisher is running.
+  static void collectStandalone();
+
+  // Exports every window to the shared memory segment
+  // /swri_profiler.<pid> (see shared_memory.h), for collectors that
+  // don't use ROS.  This is also turned on by the
+  // ~profiler/shared_memory parameter.  Returns false if the segment
+  // couldn't be created.
+  static bool setSharedMemoryExport(bool enabled);
+
+  // Attribute heap allocations and frees to the innermost open block
+  // on the calling thread.  These are called by the allocation hooks
+  // in the swri_profiler_alloc library, which also turns counting on
+  // with setCountAllocations(), so they must not allocate.  The
+  // counts are added to the enclosing block when a block closes, so
+  // the published counts include nested blocks like the durations
+  // do.
+  static void setCountAllocations(bool enabled) { count_allocations_.store(enabled); }
+  static void countAllocation(size_t bytes)
+  {
+    if (!count_allocations_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    TLS *tls = tls_.get();
+    if (tls) {
+      AllocCounts &counts = tls->allocs[tls->stack_depth];
+      counts.count++;
+      counts.bytes += bytes;
+    }
+  }
+  static void countFree()
+  {
+    if (!count_allocations_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    TLS *tls = tls_.get();
+    if (tls) {
+      tls->allocs[tls->stack_depth].frees++;
+    }
+  }
+
+  // Attribute an amount of work, such as the number of points or
+  // bytes processed, to the innermost open block on the calling
+  // thread.  The totals are published with the block's durations so
+  // that the time per item and the items per second can be tracked
+  // independently of the input size.  Work is counted for every
+  // call, including calls skipped by sampling, but is not added to
+  // enclosing blocks.
+  static void addItems(uint64_t items)
+  {
+    if (!isEnabled()) {
+      return;
+    }
+    TLS *tls = tls_.get();
+    if (tls && tls->stack_depth > 0) {
+      tls->work[tls->stack_depth].items += items;
+    }
+  }
+  static void addBytes(uint64_t bytes)
+  {
+    if (!isEnabled()) {
+      return;
+    }
+    TLS *tls = tls_.get();
+    if (tls && tls->stack_depth > 0) {
+      tls->work[tls->stack_depth].bytes += bytes;
+    }
+  }
+
+  // Turns trace mode on or off at runtime.  While tracing is on,
+  // every block also records a begin and end event to a per-thread
+  // buffer, which a background thread writes to the trace file (see
+  // the ~profiler/trace_file parameter).  The aggregated statistics
+  // are published as usual.  The background thread is started the
+  // first time tracing is enabled.
+  static void setTraceEnabled(bool enabled);
+  static bool isTraceEnabled() { return trace_enabled_.load(std::memory_order_relaxed); }
+
+  // Writes the flight recorder, which keeps the most recent timed
+  // blocks of every thread, to a new file in the trace file format
+  // and returns its name, or an empty string if nothing was written.
+  // Only the last ~profiler/flight_recorder_duration seconds are
+  // written.  Budget overruns, SIGUSR2 and the
+  // ~profiler/dump_flight_recording service also trigger this.
+  static std::string dumpFlightRecording();
+
+  // Sets the size of each thread's flight recorder in bytes, which is
+  // otherwise read from ~profiler/flight_recorder_size.  Sizes under
+  // 1024 events turn the recorder off, and it is off by default in
+  // standalone mode.  This must be called before any block is opened.
+  static void setFlightRecorderSize(size_t bytes);
+
+  // Sets the most call tree nodes the profiler tracks, which is
+  // otherwise read from ~profiler/max_nodes.  Lowering it doesn't
+  // remove nodes that already exist.
+  static void setMaxNodes(size_t max_nodes);
+
+  // Sets how long a block must go unused before it is evicted, which
+  // is otherwise read from ~profiler/idle_eviction_time.  Zero turns
+  // eviction off.
+  static void setIdleEvictionTime(double seconds);
+
+  // Starts an asynchronous span, which measures work that may finish
+  // on a different thread than the one that started it, such as a
+  // message handed from a callback to a worker pool.  The returned
+  // token can be moved between threads, and AsyncSpan::end() records
+  // the span on whichever thread calls it.  Spans are reported under
+  // the /async tree with the same statistics as scoped blocks, and
+  // are independent of the calling thread's profiler stack.  Spans
+  // that haven't ended yet are not reported.
+  static AsyncSpan beginAsync(const Label &label);
+  static AsyncSpan beginAsync(const std::string &name);
+
+  // Records a block that started at t0, in Clock ticks, and ends now.
+  // It is nested in the calling thread's innermost open block but is
+  // never pushed on the stack, so it can't have children.  This is
+  // for time that is only known after the fact, such as how long a
+  // callback waited in its queue.
+  static void recordBlock(const Label &label, int64_t t0);
+
+  // Returns the interned label for name, using the calling thread's
+  // cache of previously used labels.
+  static const Label* lookupLabel(const std::string &name)
   {
     if (!tls_.get()) { initializeTLS(); }
 
-    if (name.empty()) {
+    auto const it = tls_->labels.find(name);
+    if (it != tls_->labels.end()) {
+      return it->second;
+    }
+
+    const Label *label = internLabel(name);
+    if (label != overflow_label_.load(std::memory_order_relaxed)) {
+      tls_->labels[name] = label;
+    }
+    return label;
+  }
+
+ private:
+  static bool open(const Label &label, uint32_t sampling_period)
+  {
+    if (!label.enabled.load(std::memory_order_relaxed)) {
+      return false;
+    }
+
+    if (!tls_.get()) { initializeTLS(); }
+
+    TLS &tls = *tls_;
+    if (label.name.empty()) {
       ROS_ERROR("Profiler error: Profiled section has empty name. "
                 "Current stack is '%s'.",
-                tls_->stack_str.c_str());
+                nodePath(tls.open_blocks[tls.stack_depth].node).c_str());
       return false;
     }
     
-    if (tls_->stack_depth >= 100) {
+    if (tls.stack_depth >= max_stack_depth_) {
       ROS_ERROR("Profiler error: reached max stack size (%zu) while "
                 "opening '%s'. Current stack is '%s'.",
-                tls_->stack_depth,
-                name.c_str(),
-                tls_->stack_str.c_str());
+                tls.stack_depth,
+                label.name.c_str(),
+                nodePath(tls.open_blocks[tls.stack_depth].node).c_str());
       return false;
     }
 
-    tls_->stack_depth++;
-    tls_->stack_str = tls_->stack_str + "/" + name;
-
-    std::string open_index = tls_->thread_prefix + tls_->stack_str;
-    {
-      SpinLockGuard guard(lock_);
-      OpenInfo &info = open_blocks_[open_index];
-      info.t0 = t0;
-      info.last_report_time = ros::WallTime(0,0);
+    checkTreeGeneration(tls);
+    const size_t node = childNode(tls, tls.stack_depth, label);
+    const bool timed = sampleNext(tls, label, sampling_period);
+    TraceBuffer *trace = NULL;
+    if (trace_enabled_.load(std::memory_order_relaxed)) {
+      trace = traceBuffer(tls);
+    }
+    // The CPU time and counters are read before the clock so that the
+    // cost of the system calls isn't included in the block's duration.
+    const bool cpu_timed = timed && sampleCpu(tls);
+    const int64_t cpu0 = cpu_timed ? Clock::cpuNow() : 0;
+    const bool perf_timed = timed && PerfCounters::isEnabled() &&
+      startPerf(tls, tls.stack_depth+1);
+    const int64_t t0 = (timed || trace) ? Clock::now() : 0;
+    const bool traced = trace && trace->push(t0, label.id, TraceEvent::BEGIN);
+    if (timed) {
+      FlightRecorder *flight = flightRecorder(tls);
+      if (flight) {
+        flight->push(t0, label.id, TraceEvent::BEGIN);
+      }
+    }
+    // The frame is published by storing its tag after the other
+    // fields.
+    const size_t depth = tls.stack_depth+1;
+    OpenInfo &info = tls.open_blocks[depth];
+    info.node = node;
+    info.timed = timed;
+    info.traced = traced;
+    info.cpu_timed = cpu_timed;
+    info.perf_timed = perf_timed;
+    info.t0 = t0;
+    info.cpu0 = cpu0;
+    info.report_time.store(-static_cast<int64_t>(++tls.open_serial), std::memory_order_release);
+    tls.stack_depth = depth;
+    if (depth > tls.open_high_water.load(std::memory_order_relaxed)) {
+      tls.open_high_water.store(depth, std::memory_order_release);
     }
 
     return true;
   }
   
-  static void close(const std::string &name, const ros::WallTime &tf)
+  static void close(const Label &label)
   {    
-    std::string open_index = tls_->thread_prefix + tls_->stack_str;
-    {
-      SpinLockGuard guard(lock_);
+    TLS &tls = *tls_;
+    if (tls.stack_depth == 0) {
+      ROS_ERROR("Missing entry for '%s' in open blocks. Profiler is probably corrupted.",
+                label.name.c_str());
+      return;
+    }
 
-      auto const open_it = open_blocks_.find(open_index);
-      if (open_it == open_blocks_.end()) {
-        ROS_ERROR("Missing entry for '%s' in open_index. Profiler is probably corrupted.",
-                  name.c_str());
-        return;
+    const size_t depth = tls.stack_depth;
+    const bool timed = tls.open_blocks[depth].timed;
+    const bool traced = tls.open_blocks[depth].traced;
+    const int64_t tf = (timed || traced) ? Clock::now() : 0;
+    if (traced) {
+      tls.trace.load(std::memory_order_relaxed)->push(tf, label.id, TraceEvent::END);
+    }
+    if (timed) {
+      FlightRecorder *flight = tls.flight.load(std::memory_order_relaxed);
+      if (flight) {
+        flight->push(tf, label.id, TraceEvent::END);
       }
-      
-      ros::WallDuration abs_duration = tf - open_it->second.t0;
-      ros::WallDuration rel_duration;
-      if (open_it->second.last_report_time > open_it->second.t0) {
-        rel_duration = tf - open_it->second.last_report_time;
-      } else {
-        rel_duration = tf - open_it->second.t0;
+    }
+    PerfCounters::Values perf_counts;
+    const bool perf_timed = tls.open_blocks[depth].perf_timed && tls.perf->read(perf_counts);
+    const bool cpu_timed = tls.open_blocks[depth].cpu_timed;
+    const int64_t cpu_duration = cpu_timed ? Clock::cpuNow() - tls.open_blocks[depth].cpu0 : 0;
+
+    // Closing a timed frame returns the time that the publisher last
+    // reported it, if it did, so that only the rest of the call is
+    // counted in this window.  This is a single atomic exchange, so
+    // the owning thread never waits for the publisher.  The publisher
+    // never writes an untimed frame's tag, so a plain store closes it.
+    OpenInfo &open_info = tls.open_blocks[depth];
+    const size_t node = open_info.node;
+    const int64_t t0 = open_info.t0;
+    int64_t abs_duration = 0;
+    int64_t rel_duration = 0;
+    if (timed) {
+      const int64_t report_time = open_info.report_time.exchange(
+        closed_report_time_, std::memory_order_acq_rel);
+      abs_duration = tf - t0;
+      rel_duration = tf - std::max(t0, report_time);
+    } else {
+      open_info.report_time.store(closed_report_time_, std::memory_order_release);
+    }
+    tls.stack_depth--;
+
+    if (timed) {
+      const int64_t budget_ns = label.budget_ns.load(std::memory_order_relaxed);
+      if (budget_ns > 0) {
+        const int64_t duration_ns = Clock::toNanoseconds(abs_duration);
+        if (duration_ns > budget_ns) {
+          reportOverrun(tls, node, tf, duration_ns, budget_ns);
+        }
       }
-      open_blocks_.erase(open_it);
-      
-      ClosedInfo &info = closed_blocks_[tls_->stack_str];
-      info.count++;
-      if (info.count == 1) {
-        info.total_duration = abs_duration;
-        info.max_duration = abs_duration;
-        info.rel_duration = rel_duration;
-      } else {
+    }
+
+    AllocCounts allocs;
+    if (count_allocations_.load(std::memory_order_relaxed)) {
+      allocs = tls.allocs[depth];
+      tls.allocs[depth] = AllocCounts();
+      AllocCounts &parent = tls.allocs[depth-1];
+      parent.count += allocs.count;
+      parent.bytes += allocs.bytes;
+      parent.frees += allocs.frees;
+    }
+    const WorkCounts work = tls.work[depth];
+    tls.work[depth] = WorkCounts();
+
+    // Untimed calls are recorded here too, so that every call is
+    // counted in the window it closed in.  The epoch must be marked
+    // odd before reading the active buffer (and the publisher flips
+    // the buffer before reading the epoch) for the handoff to be
+    // safe, hence the sequentially consistent store.
+    const uint64_t epoch = tls.epoch.load(std::memory_order_relaxed);
+    tls.epoch.store(epoch + 1, std::memory_order_seq_cst);
+    {
+      const int active = tls.active.load(std::memory_order_seq_cst);
+      ClosedTable &table = tls.closed_blocks[active];
+      if (node >= table.blocks.size()) {
+        table.blocks.resize(node+1);
+      }
+      ClosedInfo &info = table.blocks[node];
+      if (info.count == 0 && info.untimed_count == 0) {
+        table.touched.push_back(node);
+      }
+      info.alloc_count += allocs.count;
+      info.alloc_bytes += allocs.bytes;
+      info.free_count += allocs.frees;
+      info.items += work.items;
+      info.bytes += work.bytes;
+      if (cpu_timed) {
+        info.cpu_count++;
+        info.cpu_duration += cpu_duration;
+      }
+      if (perf_timed) {
+        info.perf_count++;
+        const PerfCounters::Values &perf_start = tls.perf_start[depth];
+        for (size_t i = 0; i < PerfCounters::size(); i++) {
+          info.perf_counts[i] += perf_counts.counts[i] - perf_start.counts[i];
+        }
+      }
+      if (timed) {
+        if (!info.histogram) {
+          info.histogram.reset(new LatencyHistogram());
+        }
+        info.count++;
         info.total_duration += abs_duration;
         info.rel_duration += rel_duration;
         info.max_duration = std::max(info.max_duration, abs_duration);
+        info.histogram->record(abs_duration);
+        info.addExemplar(Exemplar{t0, abs_duration, tls.thread_id}, exemplars_per_block_);
+      } else {
+        info.untimed_count++;
       }
     }
-
-    const size_t len = name.size()+1;  
-    tls_->stack_str.erase(tls_->stack_str.size()-len, len);
-    tls_->stack_depth--;    
+    tls.epoch.store(epoch + 2, std::memory_order_release);
   }
 
+  // Used by AsyncSpan.
+  friend class AsyncSpan;
+  static AsyncSpan beginAsync(const Label &label, size_t parent);
+  static void endAsync(size_t node, int64_t t0);
+
  private:
-  std::string name_;
+  // The label of the open block, or NULL if the block failed to
+  // open.
+  const Label *label_;
   
  public:
-  Profiler(const std::string &name)
+  Profiler(const Label &label, uint32_t sampling_period = 1)
+    :
+    label_(NULL)
   {
-    if (open(name, ros::WallTime::now())) {
-      name_ = name;
-    } else {
-      name_ = "";
+    if (isEnabled() && open(label, sampling_period)) {
+      label_ = &label;
+    }
+  }
+
+  Profiler(const std::string &name, uint32_t sampling_period = 1)
+    :
+    label_(NULL)
+  {
+    if (!isEnabled()) {
+      return;
+    }
+
+    const Label &label = *lookupLabel(name);
+    if (open(label, sampling_period)) {
+      label_ = &label;
     }
   }
+
+  // Used by SWRI_PROFILE.  The label is only resolved if the profiler
+  // is enabled, so a disabled profiler never touches the call site's
+  // cache or thread local storage.
+  template<typename Name>
+  Profiler(LabelSite &site, Name &&name, uint32_t sampling_period = 1);
+
+  // Used by SWRI_PROFILE_BUDGET.  The budget only applies if the
+  // label doesn't have one yet.
+  template<typename Name>
+  Profiler(LabelSite &site, Name &&name, uint32_t sampling_period, double budget);
   
   ~Profiler()
   {
-    if (!name_.empty()) {
-      close(name_, ros::WallTime::now());
+    if (label_) {
+      close(*label_);
     }
   }
 };  
+
+// LabelSite caches the label used at a single SWRI_PROFILE call
+// site.  String literals are interned the first time the site runs
+// and every later call reuses the cached label without hashing or
+// allocating.  Other strings may change between calls, even const
+// char arrays such as kNames[i], so they are looked up every time.
+// The macros tell literals apart by their spelling (see
+// SWRI_PROFILER_IS_LITERAL), since the type of a literal is the same
+// as any other const char array's.
+class LabelSite
+{
+  std::atomic<const Label*> label_;
+  const bool literal_;
+
+ public:
+  constexpr explicit LabelSite(bool literal) : label_(nullptr), literal_(literal) {}
+
+  template<size_t N>
+  const Label& resolve(const char (&name)[N])
+  {
+    if (!literal_) {
+      return *Profiler::lookupLabel(name);
+    }
+    const Label *label = label_.load(std::memory_order_acquire);
+    if (!label) {
+      label = Profiler::lookupLabel(name);
+      label_.store(label, std::memory_order_release);
+    }
+    return *label;
+  }
+
+  const Label& resolve(const std::string &name)
+  {
+    return *Profiler::lookupLabel(name);
+  }
+};
+
+// AsyncSpan is the token for a span started by
+// Profiler::beginAsync().  It can be moved but not copied, so each
+// span ends at most once.  A span that is destroyed without calling
+// end() is discarded, so dropped work doesn't skew the statistics.
+class AsyncSpan
+{
+  friend class Profiler;
+
+  // The span's call tree node, or zero if the span isn't active.
+  size_t node_;
+  int64_t t0_;
+
+  AsyncSpan(size_t node, int64_t t0) : node_(node), t0_(t0) {}
+
+ public:
+  AsyncSpan() : node_(0), t0_(0) {}
+
+  AsyncSpan(AsyncSpan &&other) : node_(other.node_), t0_(other.t0_)
+  {
+    other.node_ = 0;
+  }
+
+  AsyncSpan& operator=(AsyncSpan &&other)
+  {
+    node_ = other.node_;
+    t0_ = other.t0_;
+    other.node_ = 0;
+    return *this;
+  }
+
+  AsyncSpan(const AsyncSpan&) = delete;
+  AsyncSpan& operator=(const AsyncSpan&) = delete;
+
+  bool isActive() const { return node_ != 0; }
+
+  // Records the span.  This can be called from any thread.
+  void end()
+  {
+    if (node_ != 0) {
+      Profiler::endAsync(node_, t0_);
+      node_ = 0;
+    }
+  }
+
+  // Starts a span nested under this one, for example one stage of a
+  // pipeline.  The child must be ended separately.
+  AsyncSpan child(const std::string &name) const
+  {
+    if (node_ == 0 || !Profiler::isEnabled()) {
+      return AsyncSpan();
+    }
+    return Profiler::beginAsync(*Profiler::lookupLabel(name), node_);
+  }
+};
+
+inline AsyncSpan Profiler::beginAsync(const Label &label)
+{
+  if (!isEnabled()) {
+    return AsyncSpan();
+  }
+  return beginAsync(label, asyncRoot());
+}
+
+inline AsyncSpan Profiler::beginAsync(const std::string &name)
+{
+  if (!isEnabled()) {
+    return AsyncSpan();
+  }
+  return beginAsync(*lookupLabel(name), asyncRoot());
+}
+
+inline AsyncSpan Profiler::beginAsync(const Label &label, size_t parent)
+{
+  if (!label.enabled.load(std::memory_order_relaxed) || label.name.empty()) {
+    return AsyncSpan();
+  }
+  if (!tls_.get()) { initializeTLS(); }
+  checkTreeGeneration(*tls_);
+  return AsyncSpan(lookupChild(*tls_, parent, label), Clock::now());
+}
+
+inline void Profiler::endAsync(size_t node, int64_t t0)
+{
+  const int64_t duration = Clock::now() - t0;
+  if (!tls_.get()) { initializeTLS(); }
+  TLS &tls = *tls_;
+
+  // Spans are recorded into the ending thread's table with the same
+  // handoff as close().  They are never reported while open, so the
+  // whole span counts towards the interval it ends in.
+  const uint64_t epoch = tls.epoch.load(std::memory_order_relaxed);
+  tls.epoch.store(epoch + 1, std::memory_order_seq_cst);
+  {
+    ClosedTable &table = tls.closed_blocks[tls.active.load(std::memory_order_seq_cst)];
+    if (node >= table.blocks.size()) {
+      table.blocks.resize(node+1);
+    }
+    ClosedInfo &info = table.blocks[node];
+    if (info.count == 0 && info.untimed_count == 0) {
+      table.touched.push_back(node);
+    }
+    if (!info.histogram) {
+      info.histogram.reset(new LatencyHistogram());
+    }
+    info.count++;
+    info.total_duration += duration;
+    info.rel_duration += duration;
+    info.max_duration = std::max(info.max_duration, duration);
+    info.histogram->record(duration);
+    info.addExemplar(Exemplar{t0, duration, tls.thread_id}, exemplars_per_block_);
+  }
+  tls.epoch.store(epoch + 2, std::memory_order_release);
+}
+
+inline void Profiler::recordBlock(const Label &label, int64_t t0)
+{
+  if (!isEnabled() || !label.enabled.load(std::memory_order_relaxed) || label.name.empty()) {
+    return;
+  }
+  if (!tls_.get()) { initializeTLS(); }
+  TLS &tls = *tls_;
+  checkTreeGeneration(tls);
+  endAsync(childNode(tls, tls.stack_depth, label), t0);
+}
+
+template<typename Name>
+Profiler::Profiler(LabelSite &site, Name &&name, uint32_t sampling_period)
+  :
+  label_(NULL)
+{
+  if (!isEnabled()) {
+    return;
+  }
+
+  const Label &label = site.resolve(name);
+  if (open(label, sampling_period)) {
+    label_ = &label;
+  }
+}
+
+template<typename Name>
+Profiler::Profiler(LabelSite &site, Name &&name, uint32_t sampling_period, double budget)
+  :
+  label_(NULL)
+{
+  if (!isEnabled()) {
+    return;
+  }
+
+  const Label &label = site.resolve(name);
+  if (label.budget_ns.load(std::memory_order_relaxed) == 0) {
+    int64_t unset = 0;
+    const int64_t budget_ns = budget > 0.0 ? static_cast<int64_t>(budget * 1e9) : -1;
+    label.budget_ns.compare_exchange_strong(unset, budget_ns, std::memory_order_relaxed);
+  }
+  if (open(label, sampling_period)) {
+    label_ = &label;
+  }
+}
 }  // namespace swri_profiler
 
 // Macros for string concatenation that work with built in macros.
 #define SWRI_PROFILER_CONCAT_DIRECT(s1,s2) s1##s2
 #define SWRI_PROFILER_CONCAT(s1, s2) SWRI_PROFILER_CONCAT_DIRECT(s1,s2)
 
-#define SWRI_PROFILER_IMP(block_var, name)             \
-  swri_profiler::Profiler block_var(name);             \
+// True if the macro argument name is spelled as a string literal.
+// Only literals are cached by the call site's LabelSite.
+#define SWRI_PROFILER_IS_LITERAL(name) (#name[0] == '"')
+
+#define SWRI_PROFILER_IMP(block_var, name)                              \
+  static swri_profiler::LabelSite SWRI_PROFILER_CONCAT(block_var, _site)( \
+    SWRI_PROFILER_IS_LITERAL(name));                                    \
+  swri_profiler::Profiler block_var(                                    \
+    SWRI_PROFILER_CONCAT(block_var, _site), name);                      \
+
+#define SWRI_PROFILER_SAMPLED_IMP(block_var, name, period)              \
+  static swri_profiler::LabelSite SWRI_PROFILER_CONCAT(block_var, _site)( \
+    SWRI_PROFILER_IS_LITERAL(name));                                    \
+  swri_profiler::Profiler block_var(                                    \
+    SWRI_PROFILER_CONCAT(block_var, _site), name, period);              \
+
+#define SWRI_PROFILER_BUDGET_IMP(block_var, name, seconds)              \
+  static swri_profiler::LabelSite SWRI_PROFILER_CONCAT(block_var, _site)( \
+    SWRI_PROFILER_IS_LITERAL(name));                                    \
+  swri_profiler::Profiler block_var(                                    \
+    SWRI_PROFILER_CONCAT(block_var, _site), name, 1, seconds);          \
 
 #ifndef DISABLE_SWRI_PROFILER
 #define SWRI_PROFILE(name) SWRI_PROFILER_IMP(      \
     SWRI_PROFILER_CONCAT(prof_block_, __LINE__),   \
     name)
+// Profiles a block but only times one in every period calls to it.
+// This is meant for very hot, short blocks where timing every call
+// would cost more than the block itself.  Call counts stay exact and
+// durations are scaled up from the timed calls when published.
+#define SWRI_PROFILE_SAMPLED(name, period) SWRI_PROFILER_SAMPLED_IMP( \
+    SWRI_PROFILER_CONCAT(prof_block_, __LINE__),                      \
+    name, period)
+// Profiles a block and publishes every call that takes longer than
+// the budget, in seconds, on /profiler/overruns.  See
+// swri_profiler::Profiler::setBudget().
+#define SWRI_PROFILE_BUDGET(name, seconds) SWRI_PROFILER_BUDGET_IMP( \
+    SWRI_PROFILER_CONCAT(prof_block_, __LINE__),                    \
+    name, seconds)
+// Attribute the number of items or bytes processed to the innermost
+// open block.  See swri_profiler::Profiler::addItems().
+#define SWRI_PROFILE_ITEMS(n) swri_profiler::Profiler::addItems(n)
+#define SWRI_PROFILE_BYTES(n) swri_profiler::Profiler::addBytes(n)
+// Starts an asynchronous span and evaluates to its token.  See
+// swri_profiler::Profiler::beginAsync().
+#define SWRI_PROFILE_ASYNC_BEGIN(name) swri_profiler::Profiler::beginAsync(name)
 #else // ndef DISABLE_SWRI_PROFILER
 #define SWRI_PROFILE(name)
+#define SWRI_PROFILE_SAMPLED(name, period)
+#define SWRI_PROFILE_BUDGET(name, seconds)
+#define SWRI_PROFILE_ITEMS(n)
+#define SWRI_PROFILE_BYTES(n)
+#define SWRI_PROFILE_ASYNC_BEGIN(name) swri_profiler::AsyncSpan()
 #endif // def DISABLE_SWRI_PROFILER
 
 #endif  // SWRI_PROFILER_PROFILER_H_
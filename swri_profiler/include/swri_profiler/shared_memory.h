@@ -0,0 +1,170 @@
+#ifndef SWRI_PROFILER_SHARED_MEMORY_H_
+#define SWRI_PROFILER_SHARED_MEMORY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace swri_profiler
+{
+// The profiler can export its data to a POSIX shared memory segment
+// named /swri_profiler.<pid> (see the ~profiler/shared_memory
+// parameter), so that collectors on the same host can read every
+// process's data without ROS.  The segment starts with a
+// SharedMemoryHeader, followed by an array of max_blocks
+// SharedMemoryBlocks at blocks_offset and a table of label strings at
+// string_table_offset.  All offsets are in bytes from the start of the
+// segment, and everything is in host byte order.
+//
+// The profiler rewrites the segment once per reporting window.  The
+// header's sequence is a seqlock: it is odd while the segment is
+// being written, and readers must retry if it was odd or changed
+// while they were copying.  SharedMemoryReader does this.
+static const char shared_memory_magic_[8] = { 'S', 'W', 'R', 'I', 'P', 'R', 'F', '\0' };
+static const uint32_t shared_memory_version_ = 2;
+static const size_t shared_memory_max_counters_ = 4;
+
+struct SharedMemoryHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t pid;
+  std::atomic<uint64_t> sequence;
+
+  // The wall time at the end of the latest window, and its length.
+  int64_t stamp_ns;
+  int64_t period_ns;
+
+  uint32_t max_blocks;
+  uint32_t block_count;
+  uint32_t blocks_offset;
+  uint32_t string_table_offset;
+  uint32_t string_table_size;
+  uint32_t string_table_used;
+
+  // The perf events in SharedMemoryBlock::rel_counters (see the
+  // ~profiler/perf_counters parameter).
+  uint32_t counter_count;
+  char counter_names[shared_memory_max_counters_][32];
+
+  char node_name[256];
+};
+
+// One block's data, with the same meaning as the fields of
+// swri_profiler_msgs/ProfileData.  The label is the block's full path,
+// stored at label_offset in the string table without a terminating
+// null.  label_size is zero if the string table was too small.
+struct SharedMemoryBlock
+{
+  uint32_t key;
+  uint32_t label_offset;
+  uint32_t label_size;
+  uint32_t reserved;
+
+  uint64_t abs_call_count;
+  uint64_t rel_call_count;
+  uint64_t rel_timed_call_count;
+  int64_t abs_total_duration_ns;
+  int64_t rel_total_duration_ns;
+  int64_t rel_max_duration_ns;
+  int64_t rel_p50_duration_ns;
+  int64_t rel_p90_duration_ns;
+  int64_t rel_p99_duration_ns;
+  int64_t rel_p999_duration_ns;
+  int64_t rel_overhead_duration_ns;
+  int64_t rel_cpu_duration_ns;
+  int64_t abs_cpu_duration_ns;
+  uint64_t rel_alloc_count;
+  uint64_t rel_alloc_bytes;
+  uint64_t abs_alloc_count;
+  uint64_t abs_alloc_bytes;
+  uint64_t rel_counters[shared_memory_max_counters_];
+  uint64_t rel_items;
+  uint64_t rel_bytes;
+  uint64_t abs_items;
+  uint64_t abs_bytes;
+};
+
+// Writes the shared memory segment.  Used by the profiler's publishing
+// thread.
+class SharedMemoryWriter
+{
+  std::string name_;
+  void *data_;
+  size_t size_;
+  SharedMemoryHeader *header_;
+  SharedMemoryBlock *blocks_;
+  char *string_table_;
+
+  // The location of each key's label in the string table.
+  std::unordered_map<uint32_t, std::pair<uint32_t, uint32_t> > labels_;
+  uint64_t sequence_;
+
+ public:
+  SharedMemoryWriter();
+  // Closes and removes the segment.
+  ~SharedMemoryWriter();
+
+  bool open(const std::string &name,
+            const std::string &node_name,
+            size_t max_blocks,
+            size_t string_table_size);
+  void close();
+  bool isOpen() const { return header_ != NULL; }
+  // Removes the segment's name, leaving it mapped until close().
+  void unlink();
+
+  // Rewrites the segment.  Call beginUpdate(), then addBlock() for
+  // every block, then endUpdate().  If labels_changed is set, the
+  // string table is rebuilt, which drops the labels of blocks that are
+  // no longer reported.
+  void beginUpdate(int64_t stamp_ns,
+                   int64_t period_ns,
+                   bool labels_changed,
+                   const std::vector<std::string> &counter_names);
+  void addBlock(const SharedMemoryBlock &block, const std::string &label);
+  void endUpdate();
+};
+
+// A consistent copy of a process's shared memory segment.
+struct SharedMemorySnapshot
+{
+  uint32_t pid;
+  uint64_t sequence;
+  std::string node_name;
+  int64_t stamp_ns;
+  int64_t period_ns;
+  std::vector<std::string> counter_names;
+  std::vector<SharedMemoryBlock> blocks;
+  // The label of each block.
+  std::vector<std::string> labels;
+};
+
+// Reads a profiler's shared memory segment.  This doesn't depend on
+// ROS, so it can be used by collectors that run without a master.
+class SharedMemoryReader
+{
+  void *data_;
+  size_t size_;
+
+ public:
+  SharedMemoryReader();
+  ~SharedMemoryReader();
+
+  // Returns the names of the segments that exist on this host.  A
+  // process that crashed leaves its segment behind, so check that the
+  // snapshot's pid is still running.
+  static std::vector<std::string> list();
+
+  bool open(const std::string &name);
+  void close();
+  bool isOpen() const { return data_ != NULL; }
+
+  // Copies the latest data.  Returns false if the segment is invalid
+  // or was being rewritten for too long.
+  bool read(SharedMemorySnapshot &snapshot) const;
+};
+}  // namespace swri_profiler
+#endif  // SWRI_PROFILER_SHARED_MEMORY_H_
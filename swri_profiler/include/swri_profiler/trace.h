@@ -0,0 +1,160 @@
+#ifndef SWRI_PROFILER_TRACE_H_
+#define SWRI_PROFILER_TRACE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace swri_profiler
+{
+// TraceEvent records a profiled block opening or closing.  In a
+// TraceBuffer the time is in Clock ticks.  Trace files store it in
+// nanoseconds of wall time.
+struct TraceEvent
+{
+  enum Type
+  {
+    BEGIN = 0,
+    END = 1
+  };
+
+  int64_t time;
+  uint32_t label_id;
+  uint32_t type;
+};
+
+// TraceBuffer is a fixed size ring of trace events with a single
+// writer (the thread that owns it) and a single reader (the thread
+// that writes the trace file).  Neither side locks or allocates.  When
+// the reader falls behind and the ring fills up, new events are
+// dropped and counted rather than overwriting events that haven't
+// been read.
+class TraceBuffer
+{
+  std::unique_ptr<TraceEvent[]> events_;
+  const uint64_t mask_;
+
+  // head_ is only written by the owning thread and tail_ by the
+  // reader.  They are kept on separate cache lines so that the two
+  // threads don't bounce a line between them on every event.
+  alignas(64) std::atomic<uint64_t> head_;
+  alignas(64) std::atomic<uint64_t> tail_;
+  std::atomic<uint64_t> dropped_;
+
+ public:
+  // The capacity must be a power of two.
+  explicit TraceBuffer(size_t capacity)
+    :
+    events_(new TraceEvent[capacity]),
+    mask_(capacity - 1),
+    head_(0),
+    tail_(0),
+    dropped_(0)
+  {}
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // Appends an event.  Returns false if the event was dropped
+  // because the buffer is full.
+  bool push(int64_t time, uint32_t label_id, TraceEvent::Type type)
+  {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) > mask_) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    TraceEvent &event = events_[head & mask_];
+    event.time = time;
+    event.label_id = label_id;
+    event.type = type;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Moves every event that has been pushed so far to the end of out.
+  // Only the reader may call this.
+  void drain(std::vector<TraceEvent> &out)
+  {
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    for (uint64_t i = tail; i != head; i++) {
+      out.push_back(events_[i & mask_]);
+    }
+    tail_.store(head, std::memory_order_release);
+  }
+
+  // Returns the number of events dropped since the last call.
+  uint64_t takeDropped()
+  {
+    return dropped_.exchange(0, std::memory_order_relaxed);
+  }
+};
+
+// FlightRecorder is a fixed size ring of trace events that always
+// holds a thread's most recent events, overwriting the oldest ones.
+// Unlike TraceBuffer, nothing drains it: it has a single writer (the
+// thread that owns it) and is only read when a flight recording is
+// dumped, without stopping the writer.
+class FlightRecorder
+{
+  std::unique_ptr<TraceEvent[]> events_;
+  const uint64_t mask_;
+
+  // started_ counts the events that the writer has begun to write,
+  // and head_ those that it has finished.  A reader uses started_ to
+  // tell which of the events it copied may have been overwritten
+  // while it was copying them.
+  std::atomic<uint64_t> started_;
+  std::atomic<uint64_t> head_;
+
+ public:
+  // The capacity must be a power of two.
+  explicit FlightRecorder(size_t capacity)
+    :
+    events_(new TraceEvent[capacity]),
+    mask_(capacity - 1),
+    started_(0),
+    head_(0)
+  {}
+
+  size_t capacity() const { return mask_ + 1; }
+
+  void push(int64_t time, uint32_t label_id, TraceEvent::Type type)
+  {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    started_.store(head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    TraceEvent &event = events_[head & mask_];
+    event.time = time;
+    event.label_id = label_id;
+    event.type = type;
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // Copies the events in the ring to the end of out, oldest first.
+  // Any thread may call this.
+  void snapshot(std::vector<TraceEvent> &out) const
+  {
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    const uint64_t begin = head > capacity() ? head - capacity() : 0;
+    const size_t first = out.size();
+    for (uint64_t i = begin; i != head; i++) {
+      out.push_back(events_[i & mask_]);
+    }
+
+    // Drop the oldest events if the writer has started to overwrite
+    // them since we read head_.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t started = started_.load(std::memory_order_relaxed);
+    if (started > capacity() && started - capacity() > begin) {
+      const uint64_t torn = std::min(head, started - capacity()) - begin;
+      out.erase(out.begin() + first, out.begin() + first + torn);
+    }
+  }
+};
+}  // namespace swri_profiler
+#endif  // SWRI_PROFILER_TRACE_H_
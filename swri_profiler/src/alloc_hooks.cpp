@@ -0,0 +1,121 @@
+// Heap allocation hooks for the profiler.  Linking this library into a
+// node (or preloading it with LD_PRELOAD) replaces the C allocation
+// functions with versions that count each call against the innermost
+// profiled block and then forward to glibc's implementation.
+// libstdc++'s operator new and delete are built on malloc and free, so
+// C++ allocations are counted too.
+#include <swri_profiler/profiler.h>
+
+#include <errno.h>
+#include <stddef.h>
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void *ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+}
+
+namespace
+{
+// Set while a hook is counting, so that anything the profiler does in
+// the process can't recurse into the hooks.  This uses the
+// initial-exec model because the general TLS model may itself
+// allocate.
+__thread bool in_hook_ __attribute__((tls_model("initial-exec"))) = false;
+
+void countAllocation(size_t bytes)
+{
+  if (in_hook_) {
+    return;
+  }
+  in_hook_ = true;
+  swri_profiler::Profiler::countAllocation(bytes);
+  in_hook_ = false;
+}
+
+void countFree()
+{
+  if (in_hook_) {
+    return;
+  }
+  in_hook_ = true;
+  swri_profiler::Profiler::countFree();
+  in_hook_ = false;
+}
+
+// Counting is only turned on once this library has been initialized,
+// which happens after the profiler library it depends on, and is
+// turned off before the profiler's statics are destroyed.
+__attribute__((constructor)) void installHooks()
+{
+  swri_profiler::Profiler::setCountAllocations(true);
+}
+
+__attribute__((destructor)) void removeHooks()
+{
+  swri_profiler::Profiler::setCountAllocations(false);
+}
+}  // namespace
+
+extern "C" {
+void* malloc(size_t size)
+{
+  countAllocation(size);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+  countAllocation(count * size);
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void *ptr, size_t size)
+{
+  // realloc(ptr, 0) frees and realloc(NULL, size) allocates.
+  // Anything else is counted as a new allocation of the full size,
+  // since it may move the block.
+  if (ptr && size == 0) {
+    countFree();
+  } else {
+    countAllocation(size);
+  }
+  return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+  countAllocation(size);
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+  countAllocation(size);
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+  if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  countAllocation(size);
+  void *result = __libc_memalign(alignment, size);
+  if (!result) {
+    return ENOMEM;
+  }
+  *ptr = result;
+  return 0;
+}
+
+void free(void *ptr)
+{
+  if (ptr) {
+    countFree();
+  }
+  __libc_free(ptr);
+}
+}  // extern "C"
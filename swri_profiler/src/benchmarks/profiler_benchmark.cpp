@@ -0,0 +1,425 @@
+// Microbenchmarks for the profiler's recording path.  Each scenario
+// reports the average CPU time of one profiled scope in nanoseconds,
+// with the cost of the benchmark loop itself subtracted.  The profiler runs
+// in standalone mode, so no ROS master is needed.
+//
+// The stall scenario instead measures the wall time of single scopes
+// while the publisher collects data, to check that the publisher
+// never makes a worker wait, however many blocks it tracks.
+//
+// usage: profiler_benchmark [--json] [--quick] [--flight-recorder]
+//
+// Results are written to stdout as CSV, or as JSON with --json, so
+// they can be compared between releases.  --quick shortens each
+// measurement for smoke testing.  The flight recorder is off in
+// standalone mode, and --flight-recorder turns it on with its default
+// size so that its cost can be measured.  Every result records
+// whether it was on.
+#include <swri_profiler/profiler.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+struct Result
+{
+  std::string scenario;
+  int parameter;
+  int threads;
+  bool publisher;
+  size_t scopes;
+  double ns_per_scope;
+  double ns_per_scope_min;
+  double ns_per_scope_max;
+};
+
+double measure_seconds_ = 0.2;
+bool flight_recorder_ = false;
+bool publisher_ = false;
+const int repetitions_ = 5;
+double loop_ns_ = 0.0;
+
+void compilerBarrier()
+{
+  asm volatile("" ::: "memory");
+}
+
+int64_t threadCpuNanoseconds()
+{
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return static_cast<int64_t>(ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+// Runs body(iterations) on each of num_threads threads and returns the
+// average CPU time per iteration.  We use each thread's CPU time
+// rather than wall time so that the results are comparable on
+// machines with fewer cores than threads.  The threads' profiler
+// storage is only freed by a collection, so one is run afterwards
+// when the publisher isn't running.
+template<typename Body>
+double timeRun(const Body &body, size_t iterations, int num_threads)
+{
+  std::vector<int64_t> cpu_ns(num_threads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&body, &cpu_ns, iterations, t]() {
+        const int64_t start = threadCpuNanoseconds();
+        body(iterations);
+        cpu_ns[t] = threadCpuNanoseconds() - start;
+      });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  if (!publisher_) {
+    swri_profiler::Profiler::collectStandalone();
+  }
+
+  int64_t total_ns = 0;
+  for (int64_t ns : cpu_ns) {
+    total_ns += ns;
+  }
+  return static_cast<double>(total_ns) / num_threads / iterations;
+}
+
+template<typename Body>
+Result runScenario(const std::string &scenario, int parameter, int num_threads,
+                   int scopes_per_iteration, const Body &body)
+{
+  // Warm up and pick an iteration count that makes each run take
+  // about measure_seconds_.
+  size_t iterations = 1000;
+  double ns = timeRun(body, iterations, 1);
+  while (ns * iterations < measure_seconds_ * 1e8 && iterations < (1u << 30)) {
+    iterations *= 4;
+    ns = timeRun(body, iterations, 1);
+  }
+  iterations = std::max<size_t>(1000, measure_seconds_ * 1e9 / std::max(ns, 0.1));
+
+  std::vector<double> samples;
+  for (int i = 0; i < repetitions_; i++) {
+    const double ns = timeRun(body, iterations, num_threads) - loop_ns_;
+    samples.push_back(std::max(0.0, ns) / scopes_per_iteration);
+  }
+  std::sort(samples.begin(), samples.end());
+
+  Result result;
+  result.scenario = scenario;
+  result.parameter = parameter;
+  result.threads = num_threads;
+  result.publisher = false;
+  result.scopes = iterations * scopes_per_iteration * num_threads;
+  result.ns_per_scope = samples[samples.size() / 2];
+  result.ns_per_scope_min = samples.front();
+  result.ns_per_scope_max = samples.back();
+  return result;
+}
+
+void emptyLoop(size_t iterations)
+{
+  for (size_t i = 0; i < iterations; i++) {
+    compilerBarrier();
+  }
+}
+
+void emptyScope(size_t iterations)
+{
+  for (size_t i = 0; i < iterations; i++) {
+    SWRI_PROFILE("benchmark-empty");
+    compilerBarrier();
+  }
+}
+
+// Only one in period scopes is timed.  The rest cost what a call
+// skipped by sampling costs, which a large period isolates.
+void sampledScope(size_t iterations, int period)
+{
+  for (size_t i = 0; i < iterations; i++) {
+    SWRI_PROFILE_SAMPLED("benchmark-sampled", period);
+    compilerBarrier();
+  }
+}
+
+void nestedScope(int depth)
+{
+  SWRI_PROFILE("benchmark-nested");
+  compilerBarrier();
+  if (depth > 1) {
+    nestedScope(depth - 1);
+  }
+}
+
+// A runtime string that is the same on every call, which is looked
+// up in the thread's label cache.
+void dynamicLabel(size_t iterations)
+{
+  static const std::string label = "benchmark-dynamic";
+  for (size_t i = 0; i < iterations; i++) {
+    SWRI_PROFILE(label);
+    compilerBarrier();
+  }
+}
+
+// One label, looked up once with lookupLabel() like
+// ProfiledCallbackQueue and ProfiledMutex do, and used from
+// hot_label_sites_ call sites in turn.  This is the hot counterpart
+// of cold_labels: the label is never looked up again, and each call
+// site's parent and label stay the same.
+const int hot_label_sites_ = 4;
+void hotLabel(size_t iterations)
+{
+  const swri_profiler::Label &label =
+    *swri_profiler::Profiler::lookupLabel("benchmark-hot");
+  for (size_t i = 0; i < iterations; i += hot_label_sites_) {
+    {
+      swri_profiler::Profiler block(label);
+      compilerBarrier();
+    }
+    {
+      swri_profiler::Profiler block(label);
+      compilerBarrier();
+    }
+    {
+      swri_profiler::Profiler block(label);
+      compilerBarrier();
+    }
+    {
+      swri_profiler::Profiler block(label);
+      compilerBarrier();
+    }
+  }
+}
+
+// Cycles through many runtime labels so that the call site's child
+// cache never hits.  After the first pass every label is in the
+// thread's label and call tree maps, so this measures their hash
+// lookups rather than the first use of a label.
+std::vector<std::string> cold_labels_;
+void coldLabels(size_t iterations)
+{
+  for (size_t i = 0; i < iterations; i++) {
+    SWRI_PROFILE(cold_labels_[i % cold_labels_.size()]);
+    compilerBarrier();
+  }
+}
+
+// The wall time of the timed scopes on one thread of the stall
+// scenario.
+struct StallTimes
+{
+  swri_profiler::LatencyHistogram histogram;
+  int64_t min_ns;
+  int64_t max_ns;
+  StallTimes() : min_ns(std::numeric_limits<int64_t>::max()), max_ns(0) {}
+};
+
+// Opens a stack of blocks that stay open while the publisher runs,
+// so that it has to report them, and then times each call to an
+// empty block with the wall clock until the deadline.
+void stallStack(int depth,
+                std::chrono::steady_clock::time_point deadline,
+                StallTimes &times)
+{
+  SWRI_PROFILE("benchmark-stall-stack");
+  if (depth > 1) {
+    stallStack(depth - 1, deadline, times);
+    return;
+  }
+
+  while (std::chrono::steady_clock::now() < deadline) {
+    for (int i = 0; i < 1000; i++) {
+      const auto start = std::chrono::steady_clock::now();
+      {
+        SWRI_PROFILE("benchmark-stall");
+        compilerBarrier();
+      }
+      const auto end = std::chrono::steady_clock::now();
+      const int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        end - start).count();
+      times.histogram.record(ns);
+      times.min_ns = std::min(times.min_ns, ns);
+      times.max_ns = std::max(times.max_ns, ns);
+    }
+  }
+}
+
+// Reports the median, minimum and maximum wall time of a scope while
+// the publisher tracks at least tracked_blocks blocks.  Each run
+// covers a few publishing periods.
+std::vector<std::string> tracked_labels_;
+Result stallScenario(int tracked_blocks, int num_threads, double seconds)
+{
+  while (tracked_labels_.size() < static_cast<size_t>(tracked_blocks)) {
+    tracked_labels_.push_back("benchmark-tracked-" + std::to_string(tracked_labels_.size()));
+    SWRI_PROFILE(tracked_labels_.back());
+  }
+
+  const auto deadline = std::chrono::steady_clock::now() +
+    std::chrono::microseconds(static_cast<int64_t>(seconds * 1e6));
+  std::vector<StallTimes> times(num_threads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&times, deadline, t]() {
+        stallStack(20, deadline, times[t]);
+      });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  StallTimes all;
+  for (auto const &thread_times : times) {
+    all.histogram.merge(thread_times.histogram);
+    all.min_ns = std::min(all.min_ns, thread_times.min_ns);
+    all.max_ns = std::max(all.max_ns, thread_times.max_ns);
+  }
+
+  Result result;
+  result.scenario = "stall";
+  result.parameter = tracked_blocks;
+  result.threads = num_threads;
+  result.publisher = true;
+  result.scopes = all.histogram.totalCount();
+  result.ns_per_scope = all.histogram.quantile(0.5);
+  result.ns_per_scope_min = all.min_ns;
+  result.ns_per_scope_max = all.max_ns;
+  return result;
+}
+
+void runAll(std::vector<Result> &results, bool publisher)
+{
+  std::vector<Result> new_results;
+  new_results.push_back(runScenario("empty_scope", 0, 1, 1, emptyScope));
+  const int periods[] = { 16, 1024 };
+  for (int period : periods) {
+    new_results.push_back(runScenario(
+      "sampled_scope", period, 1, 1,
+      [period](size_t iterations) { sampledScope(iterations, period); }));
+  }
+
+  const int depths[] = { 1, 2, 5, 10, 20, 50 };
+  for (int depth : depths) {
+    new_results.push_back(runScenario(
+      "nested", depth, 1, depth,
+      [depth](size_t iterations) {
+        for (size_t i = 0; i < iterations; i++) {
+          nestedScope(depth);
+        }
+      }));
+  }
+
+  const int thread_counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+  for (int num_threads : thread_counts) {
+    new_results.push_back(runScenario("threads", num_threads, num_threads, 1, emptyScope));
+  }
+
+  new_results.push_back(runScenario("hot_label", hot_label_sites_, 1, 1, hotLabel));
+  new_results.push_back(runScenario("dynamic_label", 1, 1, 1, dynamicLabel));
+  new_results.push_back(runScenario(
+    "cold_labels", cold_labels_.size(), 1, 1, coldLabels));
+
+  swri_profiler::Profiler::setEnabled(false);
+  new_results.push_back(runScenario("disabled", 0, 1, 1, emptyScope));
+  swri_profiler::Profiler::setEnabled(true);
+
+  for (auto &result : new_results) {
+    result.publisher = publisher;
+    results.push_back(result);
+  }
+}
+
+void writeCsv(const std::vector<Result> &results)
+{
+  printf("scenario,parameter,threads,publisher,scopes,ns_per_scope,ns_per_scope_min,"
+         "ns_per_scope_max,flight_recorder\n");
+  for (auto const &result : results) {
+    printf("%s,%d,%d,%d,%zu,%.2f,%.2f,%.2f,%d\n",
+           result.scenario.c_str(), result.parameter, result.threads,
+           result.publisher ? 1 : 0, result.scopes,
+           result.ns_per_scope, result.ns_per_scope_min, result.ns_per_scope_max,
+           flight_recorder_ ? 1 : 0);
+  }
+}
+
+void writeJson(const std::vector<Result> &results)
+{
+  printf("{\n  \"clock\": \"%s\",\n  \"loop_ns\": %.2f,\n  \"flight_recorder\": %s,\n"
+         "  \"results\": [\n",
+         swri_profiler::Clock::sourceName(swri_profiler::Clock::source()), loop_ns_,
+         flight_recorder_ ? "true" : "false");
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result &result = results[i];
+    printf("    {\"scenario\": \"%s\", \"parameter\": %d, \"threads\": %d, "
+           "\"publisher\": %s, \"scopes\": %zu, \"ns_per_scope\": %.2f, "
+           "\"ns_per_scope_min\": %.2f, \"ns_per_scope_max\": %.2f}%s\n",
+           result.scenario.c_str(), result.parameter, result.threads,
+           result.publisher ? "true" : "false", result.scopes,
+           result.ns_per_scope, result.ns_per_scope_min, result.ns_per_scope_max,
+           i + 1 < results.size() ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+}  // namespace
+
+int main(int argc, char **argv)
+{
+  bool json = false;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (std::strcmp(argv[i], "--quick") == 0) {
+      measure_seconds_ = 0.02;
+    } else if (std::strcmp(argv[i], "--flight-recorder") == 0) {
+      flight_recorder_ = true;
+    } else {
+      fprintf(stderr, "usage: %s [--json] [--quick] [--flight-recorder]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  // Keep the profiler's log messages out of the results.
+  ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME, ros::console::levels::Warn);
+  ros::console::notifyLoggerLevelsChanged();
+
+  swri_profiler::Profiler::initializeStandalone();
+  if (flight_recorder_) {
+    swri_profiler::Profiler::setFlightRecorderSize(1 << 20);
+  }
+  for (int i = 0; i < 4096; i++) {
+    cold_labels_.push_back("benchmark-cold-" + std::to_string(i));
+  }
+
+  // The loop overhead is measured first and subtracted from every
+  // scenario.
+  loop_ns_ = runScenario("loop", 0, 1, 1, emptyLoop).ns_per_scope;
+
+  std::vector<Result> results;
+  runAll(results, false);
+  swri_profiler::Profiler::setStandalonePublisher(true);
+  publisher_ = true;
+  runAll(results, true);
+  // The standalone publisher reports once a second, so each stall run
+  // lasts long enough to see a few updates even with --quick.
+  const int tracked_blocks[] = { 10, 1000, 5000 };
+  for (int blocks : tracked_blocks) {
+    results.push_back(stallScenario(blocks, 1, measure_seconds_ < 0.1 ? 1.5 : 3.5));
+  }
+  swri_profiler::Profiler::setStandalonePublisher(false);
+  publisher_ = false;
+
+  if (json) {
+    writeJson(results);
+  } else {
+    writeCsv(results);
+  }
+  return 0;
+}
@@ -0,0 +1,150 @@
+#include <swri_profiler/clock.h>
+
+#include <limits>
+
+#include <ros/console.h>
+
+#ifdef SWRI_PROFILER_HAVE_TSC
+#include <cpuid.h>
+#endif
+
+namespace swri_profiler
+{
+std::atomic<int> Clock::source_(Clock::WALL);
+std::atomic<int> Clock::cpu_source_(Clock::CPU_OFF);
+std::atomic<int64_t> Clock::fake_now_(0);
+bool Clock::configured_ = false;
+double Clock::ns_per_tick_ = 1.0;
+int64_t Clock::anchor_ticks_ = 0;
+int64_t Clock::anchor_wall_ns_ = 0;
+
+static int64_t monotonicNanoseconds()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return static_cast<int64_t>(ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+bool Clock::setSource(Source source)
+{
+  configured_ = true;
+
+  bool success = true;
+  double ns_per_tick = 1.0;
+  if (source == TSC) {
+    success = calibrateTsc();
+    if (success) {
+      ns_per_tick = ns_per_tick_;
+    } else {
+      source = WALL;
+    }
+  }
+
+  ns_per_tick_ = ns_per_tick;
+  source_.store(source);
+  anchor_wall_ns_ = static_cast<int64_t>(ros::WallTime::now().toNSec());
+  anchor_ticks_ = now();
+  if (source == WALL) {
+    anchor_ticks_ = anchor_wall_ns_;
+  }
+  return success;
+}
+
+const char* Clock::sourceName(Source source)
+{
+  switch (source) {
+  case WALL: return "wall";
+  case MONOTONIC_RAW: return "monotonic_raw";
+  case TSC: return "tsc";
+  case FAKE: return "fake";
+  }
+  return "unknown";
+}
+
+bool Clock::sourceFromName(const std::string &name, Source &source)
+{
+  const Source all[] = { WALL, MONOTONIC_RAW, TSC, FAKE };
+  for (Source candidate : all) {
+    if (name == sourceName(candidate)) {
+      source = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* Clock::cpuSourceName(CpuSource source)
+{
+  switch (source) {
+  case CPU_OFF: return "off";
+  case CPU_THREAD: return "thread";
+  case CPU_RUSAGE: return "rusage";
+  }
+  return "unknown";
+}
+
+bool Clock::cpuSourceFromName(const std::string &name, CpuSource &source)
+{
+  const CpuSource all[] = { CPU_OFF, CPU_THREAD, CPU_RUSAGE };
+  for (CpuSource candidate : all) {
+    if (name == cpuSourceName(candidate)) {
+      source = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Clock::calibrateTsc()
+{
+#ifdef SWRI_PROFILER_HAVE_TSC
+  // The TSC is only usable as a clock if it runs at a constant rate
+  // regardless of frequency scaling and sleep states, which CPUID
+  // reports as an invariant TSC.
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+    ROS_WARN("swri_profiler: CPU does not report TSC capabilities.");
+    return false;
+  }
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  if ((edx & (1 << 8)) == 0) {
+    ROS_WARN("swri_profiler: CPU does not have an invariant TSC.");
+    return false;
+  }
+
+  // Measure the TSC against the system clock over a short
+  // interval.  We take the best of a few tries, where best means the
+  // system clock reads were least likely to be interrupted.
+  double best_ns_per_tick = 0.0;
+  int64_t best_read_ns = std::numeric_limits<int64_t>::max();
+  for (int i = 0; i < 3; i++) {
+    const int64_t a0 = monotonicNanoseconds();
+    const int64_t tsc0 = static_cast<int64_t>(__rdtsc());
+    const int64_t b0 = monotonicNanoseconds();
+    ros::WallDuration(0.01).sleep();
+    const int64_t a1 = monotonicNanoseconds();
+    const int64_t tsc1 = static_cast<int64_t>(__rdtsc());
+    const int64_t b1 = monotonicNanoseconds();
+
+    const int64_t read_ns = (b0 - a0) + (b1 - a1);
+    if (tsc1 <= tsc0 || read_ns >= best_read_ns) {
+      continue;
+    }
+    best_read_ns = read_ns;
+    best_ns_per_tick = static_cast<double>((a1 + b1)/2 - (a0 + b0)/2) / (tsc1 - tsc0);
+  }
+
+  if (best_ns_per_tick <= 0.0) {
+    ROS_WARN("swri_profiler: Failed to calibrate the TSC.");
+    return false;
+  }
+
+  ns_per_tick_ = best_ns_per_tick;
+  ROS_DEBUG("swri_profiler: TSC calibrated at %f GHz.", 1.0 / ns_per_tick_);
+  return true;
+#else
+  ROS_WARN("swri_profiler: TSC clock is not supported on this architecture.");
+  return false;
+#endif
+}
+}  // namespace swri_profiler
@@ -0,0 +1,177 @@
+#include <swri_profiler/perf_counters.h>
+
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <ros/console.h>
+
+namespace swri_profiler
+{
+std::atomic<bool> PerfCounters::enabled_(false);
+std::vector<PerfCounters::Event> PerfCounters::events_;
+std::vector<std::string> PerfCounters::names_;
+
+int PerfCounters::openEvent(const Event &event, int group_fd)
+{
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = event.exclude_kernel;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+bool PerfCounters::configure(Mode mode)
+{
+  enabled_.store(false);
+  events_.clear();
+  names_.clear();
+  if (mode == OFF) {
+    return true;
+  }
+
+  std::vector<Event> candidates;
+  if (mode == AUTO) {
+    candidates.push_back({PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, false, "instructions"});
+    candidates.push_back({PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, false, "cache-misses"});
+  }
+  candidates.push_back({PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, false, "context-switches"});
+  candidates.push_back({PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, false, "page-faults"});
+
+  // Probe each event on this thread.  If the kernel won't let us
+  // count kernel activity (perf_event_paranoid >= 2), we settle for
+  // user space only.
+  bool have_hardware = false;
+  for (auto &event : candidates) {
+    int fd = openEvent(event, -1);
+    if (fd < 0) {
+      event.exclude_kernel = true;
+      fd = openEvent(event, -1);
+    }
+    if (fd < 0) {
+      ROS_DEBUG("swri_profiler: Can't count %s: %s", event.name.c_str(), strerror(errno));
+      continue;
+    }
+    close(fd);
+    have_hardware |= event.type == PERF_TYPE_HARDWARE;
+    events_.push_back(event);
+  }
+
+  // Without hardware counters, the task clock is the closest thing we
+  // have to a measure of work done.  It goes first so that the group
+  // leader is always the most important event.
+  if (!have_hardware) {
+    if (mode == AUTO) {
+      ROS_WARN("swri_profiler: Hardware performance counters are not available. "
+               "Counting software events only.");
+    }
+    Event task_clock = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, false, "task-clock-ns"};
+    int fd = openEvent(task_clock, -1);
+    if (fd < 0) {
+      task_clock.exclude_kernel = true;
+      fd = openEvent(task_clock, -1);
+    }
+    if (fd >= 0) {
+      close(fd);
+      events_.insert(events_.begin(), task_clock);
+    }
+  }
+
+  if (events_.size() > max_counters_) {
+    events_.resize(max_counters_);
+  }
+  if (events_.empty()) {
+    ROS_ERROR("swri_profiler: Failed to open any perf counters: %s", strerror(errno));
+    return false;
+  }
+
+  std::string description;
+  for (auto const &event : events_) {
+    names_.push_back(event.name + (event.exclude_kernel ? ":u" : ""));
+    description += " " + names_.back();
+  }
+  ROS_INFO("swri_profiler: Counting perf events:%s", description.c_str());
+  enabled_.store(true);
+  return true;
+}
+
+const char* PerfCounters::modeName(Mode mode)
+{
+  switch (mode) {
+  case OFF: return "off";
+  case AUTO: return "auto";
+  case SOFTWARE: return "software";
+  }
+  return "unknown";
+}
+
+bool PerfCounters::modeFromName(const std::string &name, Mode &mode)
+{
+  const Mode all[] = { OFF, AUTO, SOFTWARE };
+  for (Mode candidate : all) {
+    if (name == modeName(candidate)) {
+      mode = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+PerfCounters::PerfCounters()
+  :
+  group_fd_(-1)
+{
+  for (auto const &event : events_) {
+    const int fd = openEvent(event, group_fd_);
+    if (fd < 0) {
+      ROS_ERROR("swri_profiler: Failed to open %s counter for thread: %s",
+                event.name.c_str(), strerror(errno));
+      break;
+    }
+    fds_.push_back(fd);
+    if (group_fd_ < 0) {
+      group_fd_ = fd;
+    }
+  }
+
+  // A partial group would misalign the counts with the names.
+  if (fds_.size() != events_.size()) {
+    for (int fd : fds_) {
+      close(fd);
+    }
+    fds_.clear();
+    group_fd_ = -1;
+  }
+}
+
+PerfCounters::~PerfCounters()
+{
+  for (int fd : fds_) {
+    close(fd);
+  }
+}
+
+bool PerfCounters::read(Values &values) const
+{
+  struct
+  {
+    uint64_t nr;
+    uint64_t counts[max_counters_];
+  } buffer;
+
+  const ssize_t size = ::read(group_fd_, &buffer, sizeof(buffer));
+  if (size < static_cast<ssize_t>(sizeof(uint64_t)) || buffer.nr != fds_.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < fds_.size(); i++) {
+    values.counts[i] = buffer.counts[i];
+  }
+  return true;
+}
+}  // namespace swri_profiler
@@ -0,0 +1,171 @@
+#include <swri_profiler/profiled_callback_queue.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <cxxabi.h>
+
+#include <boost/make_shared.hpp>
+
+namespace swri_profiler
+{
+namespace
+{
+// Wraps a queued callback to profile it and the time it spent in the
+// queue.  roscpp queues a subscription's callback once per message, so
+// each wrapper covers a single message.
+class ProfiledCallback : public ros::CallbackInterface
+{
+  ros::CallbackInterfacePtr callback_;
+  const Label &label_;
+  const Label &wait_label_;
+  int64_t queued_;
+  bool waited_;
+
+ public:
+  ProfiledCallback(const ros::CallbackInterfacePtr &callback,
+                   const Label &label,
+                   const Label &wait_label)
+    :
+    callback_(callback),
+    label_(label),
+    wait_label_(wait_label),
+    queued_(Clock::now()),
+    waited_(false)
+  {
+  }
+
+  virtual CallResult call()
+  {
+    if (!Profiler::isEnabled()) {
+      return callback_->call();
+    }
+
+    // A callback that asks to be tried again is called again later,
+    // but it only waited in the queue once.
+    if (!waited_) {
+      Profiler::recordBlock(wait_label_, queued_);
+      waited_ = true;
+    }
+    Profiler block(label_);
+    return callback_->call();
+  }
+
+  virtual bool ready()
+  {
+    return callback_->ready();
+  }
+};
+
+std::string demangle(const char *name)
+{
+  int status = 0;
+  char *demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+  if (status != 0 || !demangled) {
+    return name;
+  }
+  std::string result(demangled);
+  free(demangled);
+  return result;
+}
+}  // namespace
+
+ProfiledCallbackQueue::ProfiledCallbackQueue(bool enabled)
+  :
+  ros::CallbackQueue(enabled)
+{
+}
+
+void ProfiledCallbackQueue::addCallback(const ros::CallbackInterfacePtr &callback,
+                                        uint64_t removal_id)
+{
+  addProfiledCallback(callback, removal_id, NULL);
+}
+
+ros::CallbackQueueInterface* ProfiledCallbackQueue::named(const std::string &name)
+{
+  std::string label = name;
+  std::replace(label.begin(), label.end(), '/', '_');
+
+  std::lock_guard<std::mutex> guard(labels_mutex_);
+  std::unique_ptr<NamedQueue> &queue = named_queues_[label];
+  if (!queue) {
+    queue.reset(new NamedQueue(*this, label));
+  }
+  return queue.get();
+}
+
+ros::Subscriber ProfiledCallbackQueue::subscribe(ros::NodeHandle &nh,
+                                                 ros::SubscribeOptions options)
+{
+  std::string topic = nh.resolveName(options.topic);
+  if (!topic.empty() && topic[0] == '/') {
+    topic.erase(0, 1);
+  }
+  options.callback_queue = named(topic);
+  return nh.subscribe(options);
+}
+
+void ProfiledCallbackQueue::addProfiledCallback(const ros::CallbackInterfacePtr &callback,
+                                                uint64_t removal_id,
+                                                const std::string *name)
+{
+  // A callback that is already wrapped, e.g. by another profiled
+  // queue, is passed through.
+  if (!callback || !Profiler::isEnabled() || typeid(*callback) == typeid(ProfiledCallback)) {
+    ros::CallbackQueue::addCallback(callback, removal_id);
+    return;
+  }
+
+  const Labels labels = name ? labelsNamed(*name) : labelsFor(*callback);
+  ros::CallbackQueue::addCallback(
+    boost::make_shared<ProfiledCallback>(callback, *labels.first, *labels.second),
+    removal_id);
+}
+
+ProfiledCallbackQueue::Labels ProfiledCallbackQueue::labelsFor(const ros::CallbackInterface &callback)
+{
+  const std::type_index type(typeid(callback));
+  std::lock_guard<std::mutex> guard(labels_mutex_);
+  auto const it = labels_.find(type);
+  if (it != labels_.end()) {
+    return it->second;
+  }
+
+  // roscpp's callback classes are internal, so we can only recognize
+  // them by name.  Anything else is named after its type.
+  const std::string type_name = demangle(type.name());
+  std::string name;
+  if (type_name.find("SubscriptionQueue") != std::string::npos) {
+    name = "subscription-callback";
+  } else if (type_name.find("TimerQueueCallback") != std::string::npos) {
+    name = "timer-callback";
+  } else if (type_name.find("ServiceCallback") != std::string::npos) {
+    name = "service-callback";
+  } else {
+    name = type_name;
+    std::replace(name.begin(), name.end(), '/', '_');
+  }
+
+  // lookupLabel() also initializes the profiler, which must choose
+  // its clock before we time anything.
+  const Labels labels(Profiler::lookupLabel(name),
+                      Profiler::lookupLabel(name + ".queue-wait"));
+  labels_[type] = labels;
+  return labels;
+}
+
+ProfiledCallbackQueue::Labels ProfiledCallbackQueue::labelsNamed(const std::string &name)
+{
+  std::lock_guard<std::mutex> guard(labels_mutex_);
+  auto const it = named_labels_.find(name);
+  if (it != named_labels_.end()) {
+    return it->second;
+  }
+
+  const Labels labels(Profiler::lookupLabel(name),
+                      Profiler::lookupLabel(name + ".queue-wait"));
+  named_labels_[name] = labels;
+  return labels;
+}
+}  // namespace swri_profiler
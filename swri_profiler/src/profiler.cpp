@@ -1,40 +1,358 @@
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <new>
+
+#include <semaphore.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include <ros/this_node.h>
 #include <swri_profiler/profiler.h>
+#include <swri_profiler/shared_memory.h>
 #include <ros/publisher.h>
+#include <std_srvs/Trigger.h>
 
 #include <swri_profiler_msgs/ProfileIndex.h>
 #include <swri_profiler_msgs/ProfileIndexArray.h>
 #include <swri_profiler_msgs/ProfileData.h>
 #include <swri_profiler_msgs/ProfileDataArray.h>
+#include <swri_profiler_msgs/ProfileDataBatch.h>
+#include <swri_profiler_msgs/ProfileOverrun.h>
 
 namespace spm = swri_profiler_msgs;
 
 namespace swri_profiler
 {
 // Define/initialize static member variables for the Profiler class.
-std::unordered_map<std::string, Profiler::ClosedInfo> Profiler::closed_blocks_;
-std::unordered_map<std::string, Profiler::OpenInfo> Profiler::open_blocks_;
-boost::thread_specific_ptr<Profiler::TLS> Profiler::tls_;
+std::vector<Profiler::TLS*> Profiler::all_tls_;
+boost::thread_specific_ptr<Profiler::TLS> Profiler::tls_(Profiler::cleanupTLS);
 SpinLock Profiler::lock_;
+std::atomic<bool> Profiler::enabled_(true);
+bool Profiler::random_sampling_ = false;
+std::atomic<bool> Profiler::trace_enabled_(false);
+std::atomic<bool> Profiler::count_allocations_(false);
+size_t Profiler::flight_recorder_events_ = 1 << 16;
+uint32_t Profiler::cpu_sampling_period_ = 1;
+const size_t Profiler::max_exemplars_;
+size_t Profiler::exemplars_per_block_ = 3;
+std::atomic<const Label*> Profiler::overflow_label_(NULL);
+std::atomic<uint32_t> Profiler::tree_generation_(0);
+
+// The label table.  Labels are stored in a deque so that their
+// addresses never change once they are interned.  Labels can't be
+// freed, so at most max_labels_ are interned and the rest share the
+// overflow label.
+static SpinLock labels_lock_;
+static std::deque<Label> labels_;
+static std::unordered_map<std::string, const Label*> label_index_;
+static size_t max_labels_ = 10000;
+static const char overflow_name_[] = "overflow";
+
+// Label prefixes that have been enabled or disabled, which are also
+// applied to labels as they are interned.  Guarded by labels_lock_.
+static std::map<std::string, bool> label_enable_rules_;
+
+// Returns whether a label is enabled by the longest matching rule.
+// labels_lock_ must be held.
+static bool labelEnabledByRules(const std::string &name)
+{
+  size_t best_length = 0;
+  bool enabled = true;
+  for (auto const &rule : label_enable_rules_) {
+    if (rule.first.size() >= best_length &&
+        name.compare(0, rule.first.size(), rule.first) == 0) {
+      best_length = rule.first.size();
+      enabled = rule.second;
+    }
+  }
+  return enabled;
+}
+
+// The call tree.  Each node is identified by its index in
+// tree_nodes_ and is the child of its parent node with a given
+// label.  Node 0 is the root of the tree.  The tree holds at most
+// max_nodes_ nodes plus the overflow nodes (see internNode()).
+// Evicted nodes are returned to free_nodes_ and reused, so a node's
+// parent doesn't necessarily have a smaller id.
+struct CallNode
+{
+  size_t parent;
+  // NULL if the node is free.
+  const Label *label;
+  // The number of children the node has in the tree.
+  size_t children;
+  bool overflow;
+  CallNode() : parent(0), label(NULL), children(0), overflow(false) {}
+};
+static SpinLock tree_lock_;
+static std::vector<CallNode> tree_nodes_(1);
+static std::unordered_map<uint64_t, size_t> tree_index_;
+static std::vector<size_t> free_nodes_;
+static size_t max_nodes_ = 10000;
+static std::atomic<size_t> async_root_(0);
+
+// The publisher's view of each call tree node, indexed like
+// tree_nodes_.  A node becomes live when the publisher first sees it
+// used.  If it then goes unused for idle_eviction_ns_, it is evicted:
+// it is removed from the tree and its key is retired.  An evicted
+// node stays out of free_nodes_ until a whole publishing cycle passes
+// without any thread using it, because threads may still hold its
+// id for a moment, and anything recorded to it meanwhile is dropped.
+enum NodeState
+{
+  NODE_FREE,
+  NODE_LIVE,
+  NODE_EVICTED
+};
+struct NodeStatus
+{
+  NodeState state;
+  int64_t last_active_ns;
+  NodeStatus() : state(NODE_FREE), last_active_ns(0) {}
+};
+static std::vector<NodeStatus> node_status_;
+static std::vector<size_t> evicted_nodes_;
+static std::atomic<int64_t> idle_eviction_ns_(0);
+static int64_t last_eviction_scan_ns_ = 0;
 
 // Declare some more variables.  These are essentially more private
 // static members for the Profiler, but by using static global
 // variables instead we are able to keep more of the implementation
 // isolated.
 static bool profiler_initialized_ = false;
+
+// Serializes initializeProfiler() and initializeStandalone().
+// profiler_initialized_ is only set, under lock_, once they finish.
+static std::mutex init_mutex_;
+
+// In standalone mode the profiler runs without ROS (see
+// Profiler::initializeStandalone()).  It reads no parameters and
+// publishes nothing, and the publishing thread runs while
+// standalone_publisher_running_ is set instead of until ROS shuts
+// down.
+static bool standalone_ = false;
+static std::atomic<bool> standalone_publisher_running_(false);
+
+static bool publisherRunning()
+{
+  if (standalone_) {
+    return standalone_publisher_running_.load();
+  }
+  return ros::ok();
+}
 static ros::Publisher profiler_index_pub_;
 static ros::Publisher profiler_data_pub_;
+static ros::Publisher profiler_data_batch_pub_;
 static boost::thread profiler_thread_;
 
-// collectAndPublish resets the closed_blocks_ member after each
-// update to reduce the amount of copying done (which might block the
-// threads doing actual work).  The incremental snapshots are
-// collected here in all_closed_blocks_;
-static std::unordered_map<std::string, spm::ProfileData> all_closed_blocks_;
+// The length of each reporting window, and the number of windows
+// that are sent in each message.  Windows are aligned to multiples of
+// the period since the epoch so that reports from different nodes
+// line up.  When more than one window is sent per message, the
+// windows are published on /profiler/data_batch instead of
+// /profiler/data.
+static const int64_t min_publish_period_ns_ = 10000000;
+static int64_t publish_period_ns_ = 1000000000;
+static int windows_per_message_ = 1;
+static spm::ProfileDataBatch pending_windows_;
+
+// Every keyframe_interval_'th window is a keyframe with every block.
+// The windows between them only contain blocks that changed.
+static int keyframe_interval_ = 1;
+static uint64_t window_sequence_ = 0;
+
+// collectAndPublish harvests each thread's closed blocks after every
+// update, so the threads only ever hold the data for a single
+// interval.  The incremental snapshots are collected here in
+// all_closed_blocks_, which is indexed by call tree node.  A key of
+// zero marks a node that hasn't been reported yet.  Keys are never
+// reused, so a node that is evicted and later used again (or whose id
+// is reused for another path) gets a new key.  reported_nodes_ lists
+// the nodes whose rel_ fields were set in the last update.
+static std::vector<spm::ProfileData> all_closed_blocks_;
+static std::vector<size_t> reported_nodes_;
+static uint32_t next_key_ = 1;
+
+// When shared memory export is enabled, every window is also written
+// to the segment /swri_profiler.<pid> (see shared_memory.h), which
+// works in standalone mode and without a ROS master.  The writer is
+// never deleted, since the publishing thread may still be running
+// while static objects are destroyed, but the segment is removed when
+// the process exits.
+static std::mutex shared_memory_mutex_;
+static SharedMemoryWriter *shared_memory_ = NULL;
+static bool shared_memory_labels_changed_ = true;
+
+// The full path of each reported node.  These are only built when a
+// node is first added to the index.
+static std::vector<std::string> node_paths_;
+
+// The profiler's own cost in Clock ticks, measured by
+// calibrateOverhead() when the publishing thread starts.
+// overhead_per_call_ is the time that a block adds to its parent, and
+// overhead_bias_ is the part of it that lands between the block's own
+// clock reads.  If subtract_overhead_ is set, the estimated overhead
+// is removed from the published total durations.
+static double overhead_per_call_ = 0.0;
+static double overhead_bias_ = 0.0;
+static bool subtract_overhead_ = false;
+
+// Trace mode.  Each thread's trace buffer holds trace_buffer_events_
+// events, and at most trace_memory_budget_ bytes are allocated for
+// trace buffers in total.  The trace thread drains the buffers every
+// trace_drain_period_ seconds.  It is started the first time tracing
+// is enabled after initializeProfiler() sets trace_thread_allowed_,
+// so a node that never traces doesn't wake up to drain nothing.
+// trace_mutex_ guards the trace file and keeps the publisher from
+// freeing a thread's storage while the trace thread is draining it or
+// a flight recording is copying it.
+static size_t trace_buffer_events_ = 1 << 18;
+static size_t trace_memory_budget_ = 64 << 20;
+static std::atomic<size_t> trace_memory_used_(0);
+static const double trace_drain_period_ = 0.1;
+static std::mutex trace_mutex_;
+static boost::thread trace_thread_;
+static std::atomic<bool> trace_thread_allowed_(false);
+static std::atomic<bool> trace_thread_started_(false);
+static std::string trace_file_name_;
+static FILE *trace_file_ = NULL;
+static size_t trace_labels_written_ = 0;
+
+// Overruns of block budgets are published by their own thread so that
+// they go out within milliseconds instead of with the next window.
+// Threads post overrun_semaphore_ to wake it, but only when
+// overrun_pending_ wasn't already set, so a burst of overruns costs a
+// single wakeup.  At most overrun_rate_ messages are published per
+// second, with bursts of up to a second's worth, and the rest are
+// counted as dropped.  overrun_mutex_ keeps the publisher from
+// freeing a thread's storage while the overrun thread is draining it.
+static ros::Publisher profiler_overrun_pub_;
+static boost::thread overrun_thread_;
+static sem_t overrun_semaphore_;
+static std::atomic<bool> overrun_pending_(false);
+static std::mutex overrun_mutex_;
+static double overrun_rate_ = 20.0;
+
+// Flight recordings are written by their own thread when they are
+// triggered by a signal or an overrun, since neither can do file I/O
+// where it is detected.  Triggers set a bit in flight_requests_ and
+// post flight_semaphore_, both of which are async-signal-safe.
+// Overruns trigger at most one recording per
+// flight_recorder_duration_ns_, so that a node that keeps overrunning
+// doesn't fill the disk with overlapping recordings.  flight_mutex_
+// serializes the recordings.
+enum FlightRequest
+{
+  FLIGHT_REQUEST_SIGNAL = 1,
+  FLIGHT_REQUEST_OVERRUN = 2
+};
+static int64_t flight_recorder_duration_ns_ = 10000000000;
+static bool flight_recorder_on_overrun_ = true;
+static std::string flight_recorder_prefix_;
+static std::mutex flight_mutex_;
+static boost::thread flight_thread_;
+static sem_t flight_semaphore_;
+static std::atomic<int> flight_requests_(0);
+static int64_t last_overrun_recording_ns_ = 0;
+static ros::ServiceServer flight_service_;
+
+// The trace file starts with trace_magic_, a uint32 format version,
+// the uint32 process id, and the node name as a uint32 length
+// followed by its characters.  The rest of the file is a sequence of
+// chunks, each a uint32 chunk type and uint32 payload size followed
+// by the payload.  A label chunk holds a uint32 label id followed by
+// the label's name.  An events chunk holds the uint32 thread id, 4
+// bytes of padding, the uint64 number of events the thread dropped
+// since its last chunk, and an array of TraceEvents with times in
+// wall clock nanoseconds.  Everything is in the writing host's byte
+// order, which readers detect from the version number (scripts/
+// convert_trace reads this format).
+static const char trace_magic_[8] = { 'S', 'W', 'R', 'I', 'T', 'R', 'C', '\0' };
+static const uint32_t trace_version_ = 1;
+enum TraceChunkType
+{
+  TRACE_CHUNK_LABEL = 1,
+  TRACE_CHUNK_EVENTS = 2
+};
+
+static void writeTraceChunk(FILE *file, uint32_t type,
+                            const void *header, size_t header_size,
+                            const void *data, size_t data_size)
+{
+  const uint32_t size = header_size + data_size;
+  fwrite(&type, sizeof(type), 1, file);
+  fwrite(&size, sizeof(size), 1, file);
+  fwrite(header, 1, header_size, file);
+  if (data_size) {
+    fwrite(data, 1, data_size, file);
+  }
+}
+
+static void writeTraceHeader(FILE *file)
+{
+  const std::string node_name = ros::this_node::getName();
+  const uint32_t pid = getpid();
+  const uint32_t name_size = node_name.size();
+  fwrite(trace_magic_, sizeof(trace_magic_), 1, file);
+  fwrite(&trace_version_, sizeof(trace_version_), 1, file);
+  fwrite(&pid, sizeof(pid), 1, file);
+  fwrite(&name_size, sizeof(name_size), 1, file);
+  fwrite(node_name.data(), 1, name_size, file);
+}
+
+// Opens the trace file if it isn't already open.  trace_mutex_ must
+// be held.
+static bool openTraceFile()
+{
+  if (trace_file_) {
+    return true;
+  }
+
+  trace_file_ = fopen(trace_file_name_.c_str(), "wb");
+  if (!trace_file_) {
+    ROS_ERROR("swri_profiler: Failed to open trace file '%s'. Disabling trace mode.",
+              trace_file_name_.c_str());
+    Profiler::setTraceEnabled(false);
+    return false;
+  }
+  ROS_INFO("swri_profiler: Writing trace to '%s'.", trace_file_name_.c_str());
+  writeTraceHeader(trace_file_);
+  return true;
+}
+
+// Writes any labels that have been interned since labels_written
+// were, and updates it.  Every event refers to a label that was
+// interned before the event was recorded, so calling this before
+// writing events guarantees that their labels are in the file.
+static void writeTraceLabels(FILE *file, size_t &labels_written)
+{
+  std::vector<std::pair<uint32_t, std::string> > new_labels;
+  {
+    SpinLockGuard guard(labels_lock_);
+    for (size_t i = labels_written; i < labels_.size(); i++) {
+      new_labels.emplace_back(labels_[i].id, labels_[i].name);
+    }
+    labels_written = labels_.size();
+  }
 
-static ros::Duration durationFromWall(const ros::WallDuration &src)
+  for (auto const &label : new_labels) {
+    writeTraceChunk(file, TRACE_CHUNK_LABEL,
+                    &label.first, sizeof(label.first),
+                    label.second.data(), label.second.size());
+  }
+}
+
+static ros::Duration durationFromTicks(int64_t ticks)
 {
-  return ros::Duration(src.sec, src.nsec);
+  ros::Duration duration;
+  duration.fromNSec(Clock::toNanoseconds(ticks));
+  return duration;
 }
 
 static ros::Time timeFromWall(const ros::WallTime &src)
@@ -42,21 +360,626 @@ static ros::Time timeFromWall(const ros::WallTime &src)
   return ros::Time(src.sec, src.nsec);
 }
 
+// Returns the prefix of the files the profiler writes, which names
+// the node and process.
+static std::string defaultFilePrefix()
+{
+  std::string prefix = "swri_profiler" + ros::this_node::getName() + "_" +
+    std::to_string(getpid());
+  std::replace(prefix.begin(), prefix.end(), '/', '_');
+  return prefix;
+}
+
+// Waits for sem to be posted or for timeout_ns to pass.
+static void waitSemaphore(sem_t &sem, int64_t timeout_ns)
+{
+  timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ns / 1000000000;
+  deadline.tv_nsec += timeout_ns % 1000000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  sem_timedwait(&sem, &deadline);
+}
+
+static void requestFlightRecording(FlightRequest request)
+{
+  flight_requests_.fetch_or(request, std::memory_order_acq_rel);
+  sem_post(&flight_semaphore_);
+}
+
+static void flightSignalHandler(int)
+{
+  requestFlightRecording(FLIGHT_REQUEST_SIGNAL);
+}
+
+static bool dumpFlightRecordingService(std_srvs::Trigger::Request &,
+                                       std_srvs::Trigger::Response &response)
+{
+  response.message = Profiler::dumpFlightRecording();
+  response.success = !response.message.empty();
+  if (!response.success) {
+    response.message = "The flight recorder is disabled or the recording couldn't be written.";
+  }
+  return true;
+}
+
+// Removes the shared memory segment's name when the process exits.
+static void unlinkSharedMemory()
+{
+  std::lock_guard<std::mutex> guard(shared_memory_mutex_);
+  if (shared_memory_) {
+    shared_memory_->unlink();
+  }
+}
+
+// Converts a block's data to its layout in the shared memory segment.
+static SharedMemoryBlock sharedMemoryBlock(const spm::ProfileData &data)
+{
+  SharedMemoryBlock block;
+  std::memset(&block, 0, sizeof(block));
+  block.key = data.key;
+  block.abs_call_count = data.abs_call_count;
+  block.rel_call_count = data.rel_call_count;
+  block.rel_timed_call_count = data.rel_timed_call_count;
+  block.abs_total_duration_ns = data.abs_total_duration.toNSec();
+  block.rel_total_duration_ns = data.rel_total_duration.toNSec();
+  block.rel_max_duration_ns = data.rel_max_duration.toNSec();
+  block.rel_p50_duration_ns = data.rel_p50_duration.toNSec();
+  block.rel_p90_duration_ns = data.rel_p90_duration.toNSec();
+  block.rel_p99_duration_ns = data.rel_p99_duration.toNSec();
+  block.rel_p999_duration_ns = data.rel_p999_duration.toNSec();
+  block.rel_overhead_duration_ns = data.rel_overhead_duration.toNSec();
+  block.rel_cpu_duration_ns = data.rel_cpu_duration.toNSec();
+  block.abs_cpu_duration_ns = data.abs_cpu_duration.toNSec();
+  block.rel_alloc_count = data.rel_alloc_count;
+  block.rel_alloc_bytes = data.rel_alloc_bytes;
+  block.abs_alloc_count = data.abs_alloc_count;
+  block.abs_alloc_bytes = data.abs_alloc_bytes;
+  block.rel_items = data.rel_items;
+  block.rel_bytes = data.rel_bytes;
+  block.abs_items = data.abs_items;
+  block.abs_bytes = data.abs_bytes;
+  for (size_t i = 0; i < data.rel_counters.size() && i < shared_memory_max_counters_; i++) {
+    block.rel_counters[i] = data.rel_counters[i];
+  }
+  return block;
+}
+
+// Adds a block's open calls to its closed calls' data.
+static void addOpenBlock(spm::ProfileData &data, const spm::ProfileData &open)
+{
+  data.abs_call_count += open.abs_call_count;
+  data.abs_total_duration += open.abs_total_duration;
+  data.rel_total_duration += open.rel_total_duration;
+  data.rel_max_duration = std::max(data.rel_max_duration, open.rel_max_duration);
+}
+
+// Returns the reported data for node, adding the node to the index
+// if this is the first time it has been reported.
+static spm::ProfileData& touchReportedNode(size_t node, bool &update_index)
+{
+  if (node >= all_closed_blocks_.size()) {
+    all_closed_blocks_.resize(node+1);
+    node_paths_.resize(node+1);
+  }
+
+  auto &info = all_closed_blocks_[node];
+  if (info.key == 0) {
+    update_index = true;
+    info.key = next_key_++;
+    if (next_key_ == 0) {
+      next_key_ = 1;
+    }
+    node_paths_[node] = Profiler::nodePath(node);
+  }
+  return info;
+}
+
 void Profiler::initializeProfiler()
 {
-  SpinLockGuard guard(lock_);
-  if (profiler_initialized_) {
-    return;
+  // Reading the parameters and calibrating the clock take tens of
+  // milliseconds, so other threads wait for them on init_mutex_
+  // instead of spinning on lock_.
+  std::lock_guard<std::mutex> init_guard(init_mutex_);
+  {
+    SpinLockGuard guard(lock_);
+    if (profiler_initialized_) {
+      return;
+    }
   }
-  
+
   ROS_INFO("Initializing swri_profiler...");
   ros::NodeHandle nh;
+  ros::NodeHandle pnh("~");
+
+  if (!Clock::isConfigured()) {
+    std::string clock_name;
+    pnh.param("profiler/clock", clock_name, std::string("tsc"));
+
+    Clock::Source source;
+    if (!Clock::sourceFromName(clock_name, source)) {
+      ROS_ERROR("swri_profiler: Unknown clock source '%s'.", clock_name.c_str());
+      source = Clock::WALL;
+    }
+    if (!Clock::setSource(source)) {
+      ROS_WARN("swri_profiler: Clock source '%s' is not available. Using '%s' instead.",
+               clock_name.c_str(), Clock::sourceName(Clock::source()));
+    }
+  }
+  ROS_INFO("swri_profiler: Using '%s' clock.", Clock::sourceName(Clock::source()));
+
+  pnh.param("profiler/random_sampling", random_sampling_, false);
+
+  std::string cpu_time;
+  if (pnh.getParam("profiler/cpu_time", cpu_time)) {
+    Clock::CpuSource cpu_source;
+    if (Clock::cpuSourceFromName(cpu_time, cpu_source)) {
+      Clock::setCpuSource(cpu_source);
+    } else {
+      ROS_ERROR("swri_profiler: Unknown CPU time source '%s'.", cpu_time.c_str());
+    }
+  }
+  int cpu_sampling_period;
+  pnh.param("profiler/cpu_time_period", cpu_sampling_period, 1);
+  cpu_sampling_period_ = std::max(1, cpu_sampling_period);
+  pnh.param("profiler/subtract_overhead", subtract_overhead_, false);
+  int exemplars;
+  pnh.param("profiler/exemplars", exemplars, 3);
+  exemplars_per_block_ = std::min<size_t>(max_exemplars_, std::max(0, exemplars));
+
+  std::string perf_counters;
+  if (pnh.getParam("profiler/perf_counters", perf_counters)) {
+    PerfCounters::Mode perf_mode;
+    if (PerfCounters::modeFromName(perf_counters, perf_mode)) {
+      PerfCounters::configure(perf_mode);
+    } else {
+      ROS_ERROR("swri_profiler: Unknown perf counter mode '%s'.", perf_counters.c_str());
+    }
+  }
+
+  pnh.param("profiler/trace_file", trace_file_name_, defaultFilePrefix() + ".trace");
+
+  // The per-thread buffer size is rounded down to a power of two
+  // number of events.
+  int trace_buffer_size;
+  pnh.param("profiler/trace_buffer_size", trace_buffer_size, 4 << 20);
+  const size_t trace_buffer_events = std::max<size_t>(
+    1024, static_cast<size_t>(std::max(0, trace_buffer_size)) / sizeof(TraceEvent));
+  trace_buffer_events_ = 1;
+  while (trace_buffer_events_ * 2 <= trace_buffer_events) {
+    trace_buffer_events_ *= 2;
+  }
+  int trace_memory_budget;
+  pnh.param("profiler/trace_memory_budget", trace_memory_budget, 64 << 20);
+  trace_memory_budget_ = std::max(0, trace_memory_budget);
+
+  bool trace_enabled;
+  if (pnh.getParam("profiler/trace_enabled", trace_enabled)) {
+    setTraceEnabled(trace_enabled);
+  }
+
+  // The flight recorder is sized like the trace buffers.
+  int flight_recorder_size;
+  pnh.param("profiler/flight_recorder_size", flight_recorder_size, 1 << 20);
+  setFlightRecorderSize(static_cast<size_t>(std::max(0, flight_recorder_size)));
+  double flight_recorder_duration;
+  pnh.param("profiler/flight_recorder_duration", flight_recorder_duration, 10.0);
+  flight_recorder_duration_ns_ =
+    static_cast<int64_t>(std::max(0.0, flight_recorder_duration) * 1e9);
+  pnh.param("profiler/flight_recorder_file", flight_recorder_prefix_,
+            defaultFilePrefix() + "_flight");
+  pnh.param("profiler/flight_recorder_on_overrun", flight_recorder_on_overrun_, true);
+  bool flight_recorder_signal;
+  pnh.param("profiler/flight_recorder_signal", flight_recorder_signal, true);
+
+  double period;
+  pnh.param("profiler/period", period, 1.0);
+  publish_period_ns_ = std::max(min_publish_period_ns_, static_cast<int64_t>(period * 1e9));
+  pnh.param("profiler/windows_per_message", windows_per_message_, 1);
+  windows_per_message_ = std::max(1, windows_per_message_);
+  pnh.param("profiler/keyframe_interval", keyframe_interval_, 1);
+  keyframe_interval_ = std::max(1, keyframe_interval_);
+  if (publish_period_ns_ != 1000000000 || windows_per_message_ != 1) {
+    ROS_INFO("swri_profiler: Reporting every %f seconds in batches of %d.",
+             publish_period_ns_ * 1e-9, windows_per_message_);
+  }
+
+  int max_nodes;
+  pnh.param("profiler/max_nodes", max_nodes, 10000);
+  int max_labels;
+  pnh.param("profiler/max_labels", max_labels, 10000);
+  double idle_eviction_time;
+  pnh.param("profiler/idle_eviction_time", idle_eviction_time, 0.0);
+  setMaxNodes(std::max(0, max_nodes));
+  {
+    SpinLockGuard labels_guard(labels_lock_);
+    max_labels_ = std::max(2, max_labels);
+  }
+  setIdleEvictionTime(idle_eviction_time);
+
+  bool shared_memory;
+  pnh.param("profiler/shared_memory", shared_memory, false);
+  if (shared_memory) {
+    setSharedMemoryExport(true);
+  }
+
+  std::map<std::string, int> sampling_periods;
+  if (pnh.getParam("profiler/sampling_periods", sampling_periods)) {
+    for (auto const &pair : sampling_periods) {
+      setSamplingPeriod(pair.first, std::max(0, pair.second));
+    }
+  }
+
+  std::map<std::string, double> budgets;
+  if (pnh.getParam("profiler/budgets", budgets)) {
+    for (auto const &pair : budgets) {
+      setBudget(pair.first, pair.second);
+    }
+  }
+  pnh.param("profiler/overrun_rate", overrun_rate_, 20.0);
+  overrun_rate_ = std::max(0.0, overrun_rate_);
+
   profiler_index_pub_ = nh.advertise<spm::ProfileIndexArray>("/profiler/index", 1, true);
-  profiler_data_pub_ = nh.advertise<spm::ProfileDataArray>("/profiler/data", 100, false);
+  if (windows_per_message_ == 1) {
+    profiler_data_pub_ = nh.advertise<spm::ProfileDataArray>("/profiler/data", 100, false);
+  } else {
+    profiler_data_batch_pub_ = nh.advertise<spm::ProfileDataBatch>("/profiler/data_batch", 100, false);
+  }
+  profiler_overrun_pub_ = nh.advertise<spm::ProfileOverrun>("/profiler/overruns", 100, false);
+  sem_init(&overrun_semaphore_, 0, 0);
+  sem_init(&flight_semaphore_, 0, 0);
   profiler_thread_ = boost::thread(Profiler::profilerMain);   
+  trace_thread_allowed_.store(true);
+  if (trace_enabled_.load()) {
+    setTraceEnabled(true);
+  }
+  overrun_thread_ = boost::thread(Profiler::overrunMain);
+  if (flight_recorder_events_ != 0) {
+    flight_service_ = pnh.advertiseService("profiler/dump_flight_recording",
+                                           dumpFlightRecordingService);
+    flight_thread_ = boost::thread(Profiler::flightMain);
+
+    // SIGUSR2 terminates the process by default, so we only take it
+    // over if the node hasn't installed its own handler.
+    struct sigaction action;
+    if (flight_recorder_signal && sigaction(SIGUSR2, NULL, &action) == 0 &&
+        action.sa_handler == SIG_DFL) {
+      memset(&action, 0, sizeof(action));
+      action.sa_handler = flightSignalHandler;
+      action.sa_flags = SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      sigaction(SIGUSR2, &action, NULL);
+    }
+  }
+
+  SpinLockGuard guard(lock_);
+  profiler_initialized_ = true;
+}
+
+void Profiler::setTraceEnabled(bool enabled)
+{
+  // Tracing may be enabled from any thread while initializeProfiler()
+  // runs, so both sides use sequentially consistent accesses and
+  // whichever sees the other's store starts the thread.
+  trace_enabled_.store(enabled);
+  if (enabled && trace_thread_allowed_.load() && !trace_thread_started_.exchange(true)) {
+    trace_thread_ = boost::thread(Profiler::traceMain);
+  }
+}
+
+void Profiler::initializeStandalone()
+{
+  std::lock_guard<std::mutex> init_guard(init_mutex_);
+  {
+    SpinLockGuard guard(lock_);
+    if (profiler_initialized_) {
+      ROS_ERROR("swri_profiler: The profiler must be made standalone before it is used.");
+      return;
+    }
+  }
+
+  // ros::init() normally initializes ros::Time, which the publishing
+  // thread uses to stamp its messages.
+  ros::Time::init();
+  if (!Clock::isConfigured()) {
+    Clock::setSource(Clock::TSC);
+  }
+  sem_init(&overrun_semaphore_, 0, 0);
+  sem_init(&flight_semaphore_, 0, 0);
+
+  // Nothing dumps the flight recorder in standalone mode unless the
+  // program asks for it, so it is only allocated on request.
+  flight_recorder_events_ = 0;
+
+  SpinLockGuard guard(lock_);
+  standalone_ = true;
   profiler_initialized_ = true;
 }
 
+void Profiler::setStandalonePublisher(bool running)
+{
+  if (!standalone_) {
+    ROS_ERROR("swri_profiler: setStandalonePublisher() requires initializeStandalone().");
+    return;
+  }
+
+  if (running && !standalone_publisher_running_.exchange(true)) {
+    profiler_thread_ = boost::thread(Profiler::profilerMain);
+  } else if (!running && standalone_publisher_running_.exchange(false)) {
+    profiler_thread_.join();
+  }
+}
+
+void Profiler::collectStandalone()
+{
+  if (!standalone_ || standalone_publisher_running_.load()) {
+    ROS_ERROR("swri_profiler: collectStandalone() requires initializeStandalone() "
+              "and no standalone publisher.");
+    return;
+  }
+  collectAndPublish();
+}
+
+bool Profiler::setSharedMemoryExport(bool enabled)
+{
+  std::lock_guard<std::mutex> guard(shared_memory_mutex_);
+  if (!enabled) {
+    if (shared_memory_) {
+      shared_memory_->close();
+    }
+    return true;
+  }
+
+  if (!shared_memory_) {
+    shared_memory_ = new SharedMemoryWriter();
+    std::atexit(unlinkSharedMemory);
+  }
+  if (shared_memory_->isOpen()) {
+    return true;
+  }
+
+  // Room for every node and its overflow node (see internNode()), and
+  // a generous average path length.
+  size_t max_blocks;
+  {
+    SpinLockGuard tree_guard(tree_lock_);
+    max_blocks = 2*max_nodes_ + 1;
+  }
+  shared_memory_labels_changed_ = true;
+  return shared_memory_->open("/swri_profiler." + std::to_string(getpid()),
+                              ros::this_node::getName(),
+                              max_blocks,
+                              max_blocks * 128);
+}
+
+const Label* Profiler::internLabel(const std::string &name)
+{
+  SpinLockGuard guard(labels_lock_);
+
+  auto const it = label_index_.find(name);
+  if (it != label_index_.end()) {
+    return it->second;
+  }
+
+  const bool overflow = labels_.size() >= max_labels_;
+  if (overflow) {
+    auto const overflow_it = label_index_.find(overflow_name_);
+    if (overflow_it != label_index_.end()) {
+      overflow_label_.store(overflow_it->second, std::memory_order_relaxed);
+      return overflow_it->second;
+    }
+    ROS_WARN("swri_profiler: Reached the limit of %zu labels. New labels will be "
+             "recorded as '%s'.", max_labels_, overflow_name_);
+  }
+
+  labels_.emplace_back();
+  Label &label = labels_.back();
+  label.id = labels_.size() - 1;
+  label.name = overflow ? overflow_name_ : name;
+  label.enabled.store(labelEnabledByRules(label.name), std::memory_order_relaxed);
+  label_index_[label.name] = &label;
+  if (overflow) {
+    overflow_label_.store(&label, std::memory_order_relaxed);
+  }
+  return &label;
+}
+
+size_t Profiler::internNode(size_t parent, size_t label_id, bool &overflow)
+{
+  const Label *label = NULL;
+  {
+    SpinLockGuard guard(labels_lock_);
+    label = &labels_[label_id];
+  }
+  static const Label *overflow_label = internLabel(overflow_name_);
+  
+  SpinLockGuard guard(tree_lock_);
+
+  // Everything inside an overflow node stays there.
+  overflow = tree_nodes_[parent].overflow;
+  if (overflow) {
+    return parent;
+  }
+
+  // A thread can still have a block open in a node that was evicted
+  // after it opened.  Nothing may be added under the evicted node, so
+  // its children are recorded in it, which drops them, and aren't
+  // cached.
+  if (parent != 0 && !tree_nodes_[parent].label) {
+    overflow = true;
+    return parent;
+  }
+
+  uint64_t key = (static_cast<uint64_t>(parent) << 32) | label_id;
+  auto it = tree_index_.find(key);
+  if (it != tree_index_.end()) {
+    overflow = tree_nodes_[it->second].overflow;
+    return it->second;
+  }
+
+  size_t node;
+  if (!free_nodes_.empty()) {
+    node = free_nodes_.back();
+    free_nodes_.pop_back();
+  } else if (tree_nodes_.size() < max_nodes_) {
+    node = tree_nodes_.size();
+    tree_nodes_.emplace_back();
+  } else {
+    // Blocks that don't fit are recorded in an overflow node under
+    // their parent, so the parent's exclusive time stays right.  There
+    // is at most one per parent, so these add at most max_nodes_ more
+    // nodes.
+    overflow = true;
+    key = (static_cast<uint64_t>(parent) << 32) | overflow_label->id;
+    it = tree_index_.find(key);
+    if (it != tree_index_.end()) {
+      return it->second;
+    }
+    static bool warned = false;
+    if (!warned) {
+      ROS_WARN("swri_profiler: Reached the limit of %zu call tree nodes. New blocks "
+               "will be recorded as '%s'.", max_nodes_, overflow_name_);
+      warned = true;
+    }
+    node = tree_nodes_.size();
+    tree_nodes_.emplace_back();
+    label = overflow_label;
+  }
+
+  tree_nodes_[node].parent = parent;
+  tree_nodes_[node].label = label;
+  tree_nodes_[node].children = 0;
+  tree_nodes_[node].overflow = overflow;
+  tree_nodes_[parent].children++;
+  tree_index_[key] = node;
+  return node;
+}
+
+// Returns the node that asynchronous spans are reported under.  It is
+// a child of the root, so it can't be confused with a scoped block
+// unless a thread opens a top level block named "async".
+size_t Profiler::asyncRoot()
+{
+  bool overflow;
+  static const size_t node = internNode(0, internLabel("async")->id, overflow);
+  async_root_.store(node, std::memory_order_relaxed);
+  return node;
+}
+
+// Returns true if node is, or is inside, the /async tree.
+// tree_lock_ must be held.
+static bool inAsyncTree(size_t node)
+{
+  const size_t async_root = async_root_.load(std::memory_order_relaxed);
+  if (async_root == 0) {
+    return false;
+  }
+  for (; node != 0; node = tree_nodes_[node].parent) {
+    if (node == async_root) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Evicts the live nodes that haven't been used for
+// idle_eviction_ns_.  A node is only evicted after all of its
+// children, so idle subtrees are removed from the leaves up over
+// several scans.  Asynchronous spans may be in flight for a long time
+// without touching their node, so they are never evicted.
+void Profiler::evictIdleNodes(int64_t now_ns, bool &update_index)
+{
+  const int64_t idle_eviction_ns = idle_eviction_ns_.load();
+  size_t evicted = 0;
+  {
+    SpinLockGuard guard(tree_lock_);
+    for (size_t node = 1; node < node_status_.size(); node++) {
+      NodeStatus &status = node_status_[node];
+      CallNode &call_node = tree_nodes_[node];
+      if (status.state != NODE_LIVE ||
+          now_ns - status.last_active_ns < idle_eviction_ns ||
+          call_node.children != 0 ||
+          inAsyncTree(node)) {
+        continue;
+      }
+
+      tree_index_.erase((static_cast<uint64_t>(call_node.parent) << 32) | call_node.label->id);
+      tree_nodes_[call_node.parent].children--;
+      call_node = CallNode();
+      status.state = NODE_EVICTED;
+      status.last_active_ns = now_ns;
+      evicted_nodes_.push_back(node);
+      evicted++;
+
+      if (node < all_closed_blocks_.size()) {
+        if (all_closed_blocks_[node].key != 0) {
+          update_index = true;
+        }
+        all_closed_blocks_[node] = spm::ProfileData();
+        node_paths_[node].clear();
+      }
+    }
+  }
+
+  if (evicted) {
+    tree_generation_.fetch_add(1, std::memory_order_release);
+    ROS_DEBUG("swri_profiler: Evicted %zu idle blocks.", evicted);
+  }
+}
+
+std::string Profiler::nodePath(size_t node)
+{
+  std::vector<const Label*> labels;
+  {
+    SpinLockGuard guard(tree_lock_);
+    while (node != 0 && node < tree_nodes_.size()) {
+      labels.push_back(tree_nodes_[node].label);
+      node = tree_nodes_[node].parent;
+    }
+  }
+
+  // Evicted nodes have no label.
+  std::string path;
+  for (auto it = labels.rbegin(); it != labels.rend(); ++it) {
+    path += "/" + (*it ? (*it)->name : std::string("(evicted)"));
+  }
+  return path;
+}
+
+void Profiler::setMaxNodes(size_t max_nodes)
+{
+  SpinLockGuard guard(tree_lock_);
+  max_nodes_ = std::max<size_t>(2, max_nodes);
+}
+
+void Profiler::setIdleEvictionTime(double seconds)
+{
+  idle_eviction_ns_.store(std::max<int64_t>(0, static_cast<int64_t>(seconds * 1e9)));
+}
+
+void Profiler::setSamplingPeriod(const std::string &name, uint32_t period)
+{
+  internLabel(name)->sampling_period.store(period, std::memory_order_relaxed);
+}
+
+void Profiler::setBudget(const std::string &name, double seconds)
+{
+  const int64_t budget_ns = seconds > 0.0 ? static_cast<int64_t>(seconds * 1e9) : -1;
+  internLabel(name)->budget_ns.store(budget_ns, std::memory_order_relaxed);
+}
+
+void Profiler::setLabelsEnabled(const std::string &prefix, bool enabled)
+{
+  SpinLockGuard guard(labels_lock_);
+  label_enable_rules_[prefix] = enabled;
+  for (auto &label : labels_) {
+    label.enabled.store(labelEnabledByRules(label.name), std::memory_order_relaxed);
+  }
+}
+
 void Profiler::initializeTLS()
 {
   if (tls_.get()) {
@@ -64,128 +987,877 @@ void Profiler::initializeTLS()
     return;
   }
 
-  tls_.reset(new TLS());
-  tls_->stack_depth = 0;
-  tls_->stack_str = "";
+  // operator new does not honor extended alignment before C++17, so
+  // we allocate the cache line aligned storage ourselves.
+  void *storage = NULL;
+  if (posix_memalign(&storage, alignof(TLS), sizeof(TLS)) != 0) {
+    ROS_ERROR("Failed to allocate profiler thread local storage.");
+    return;
+  }
+  TLS *tls = new (storage) TLS();
+  tls->open_blocks.reset(new OpenInfo[max_stack_depth_+1]);
+  tls->child_cache.resize(max_stack_depth_+1);
+  tls->allocs.resize(max_stack_depth_+1);
+  tls->work.resize(max_stack_depth_+1);
+  // Seed each thread differently so that random sampling isn't
+  // correlated between threads.  xorshift requires a non-zero state.
+  tls->rng_state = (reinterpret_cast<uintptr_t>(tls) ^ Clock::now()) | 1;
+  tls->thread_id = syscall(SYS_gettid);
+  tls_.reset(tls);
 
-  char buffer[256];
-  snprintf(buffer, sizeof(buffer), "%p/", tls_.get());
-  tls_->thread_prefix = std::string(buffer);
+  {
+    SpinLockGuard guard(lock_);
+    all_tls_.push_back(tls);
+  }
 
   initializeProfiler();
 }
 
+void Profiler::cleanupTLS(TLS *tls)
+{
+  // The publishing thread still holds a reference to this thread's
+  // storage, so we only flag it here.  The publisher collects any
+  // remaining data and frees it.
+  tls->retired.store(true, std::memory_order_release);
+}
+
+bool Profiler::initializeTrace(TLS &tls)
+{
+  const size_t bytes = trace_buffer_events_ * sizeof(TraceEvent);
+  if (trace_memory_used_.fetch_add(bytes) + bytes > trace_memory_budget_) {
+    trace_memory_used_.fetch_sub(bytes);
+    tls.trace_unavailable = true;
+    ROS_WARN("swri_profiler: Trace memory budget of %zu bytes is exhausted. "
+             "Thread %u will not be traced.", trace_memory_budget_, tls.thread_id);
+    return false;
+  }
+
+  void *storage = NULL;
+  if (posix_memalign(&storage, alignof(TraceBuffer), sizeof(TraceBuffer)) != 0) {
+    trace_memory_used_.fetch_sub(bytes);
+    tls.trace_unavailable = true;
+    ROS_ERROR("Failed to allocate profiler trace buffer.");
+    return false;
+  }
+  tls.trace.store(new (storage) TraceBuffer(trace_buffer_events_), std::memory_order_release);
+  return true;
+}
+
+bool Profiler::initializePerf(TLS &tls)
+{
+  std::unique_ptr<PerfCounters> perf(new PerfCounters());
+  if (!perf->isValid()) {
+    tls.perf_unavailable = true;
+    ROS_WARN("swri_profiler: Thread %u will not count perf events.", tls.thread_id);
+    return false;
+  }
+  tls.perf_start.resize(max_stack_depth_+1);
+  tls.perf = std::move(perf);
+  return true;
+}
+
+// Writes the thread's pending trace events to the trace file.
+// trace_mutex_ must be held.
+void Profiler::drainTrace(TLS &tls)
+{
+  TraceBuffer *trace = tls.trace.load(std::memory_order_acquire);
+  if (!trace) {
+    return;
+  }
+
+  static std::vector<TraceEvent> events;
+  events.clear();
+  trace->drain(events);
+  const uint64_t dropped = trace->takeDropped();
+  if (events.empty() && dropped == 0) {
+    return;
+  }
+  if (!openTraceFile()) {
+    return;
+  }
+
+  writeTraceLabels(trace_file_, trace_labels_written_);
+  for (auto &event : events) {
+    event.time = Clock::toWallTime(event.time).toNSec();
+  }
+
+  struct
+  {
+    uint32_t thread_id;
+    uint32_t padding;
+    uint64_t dropped;
+  } header = { tls.thread_id, 0, dropped };
+  writeTraceChunk(trace_file_, TRACE_CHUNK_EVENTS,
+                  &header, sizeof(header),
+                  events.data(), events.size() * sizeof(TraceEvent));
+}
+
+// Writes out and frees the trace buffer of a thread that has exited.
+// trace_mutex_ must be held.
+void Profiler::releaseTrace(TLS &tls)
+{
+  TraceBuffer *trace = tls.trace.load(std::memory_order_acquire);
+  if (!trace) {
+    return;
+  }
+
+  drainTrace(tls);
+  const size_t bytes = trace->capacity() * sizeof(TraceEvent);
+  trace->~TraceBuffer();
+  free(trace);
+  tls.trace.store(nullptr, std::memory_order_relaxed);
+  trace_memory_used_.fetch_sub(bytes);
+}
+
+bool Profiler::initializeFlightRecorder(TLS &tls)
+{
+  try {
+    tls.flight.store(new FlightRecorder(flight_recorder_events_), std::memory_order_release);
+  } catch (const std::bad_alloc &) {
+    tls.flight_unavailable = true;
+    ROS_ERROR("Failed to allocate profiler flight recorder.");
+    return false;
+  }
+  return true;
+}
+
+void Profiler::setFlightRecorderSize(size_t bytes)
+{
+  const size_t events = bytes / sizeof(TraceEvent);
+  flight_recorder_events_ = 0;
+  if (events >= 1024) {
+    flight_recorder_events_ = 1;
+    while (flight_recorder_events_ * 2 <= events) {
+      flight_recorder_events_ *= 2;
+    }
+  }
+}
+
+std::string Profiler::dumpFlightRecording()
+{
+  if (flight_recorder_events_ == 0) {
+    return std::string();
+  }
+
+  std::lock_guard<std::mutex> flight_guard(flight_mutex_);
+
+  // Copy every thread's recorder first, so that the recordings end at
+  // about the same time.  trace_mutex_ keeps the publisher from
+  // freeing a thread's recorder while we copy it.
+  std::vector<std::pair<uint32_t, std::vector<TraceEvent> > > recordings;
+  {
+    std::lock_guard<std::mutex> trace_guard(trace_mutex_);
+    std::vector<TLS*> threads;
+    {
+      SpinLockGuard guard(lock_);
+      threads = all_tls_;
+    }
+    for (TLS *tls : threads) {
+      const FlightRecorder *flight = tls->flight.load(std::memory_order_acquire);
+      if (flight) {
+        recordings.emplace_back(tls->thread_id, std::vector<TraceEvent>());
+        flight->snapshot(recordings.back().second);
+      }
+    }
+  }
+
+  const ros::WallTime now = ros::WallTime::now();
+  const time_t now_sec = now.sec;
+  tm now_tm;
+  localtime_r(&now_sec, &now_tm);
+  char stamp[32];
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &now_tm);
+  char millis[8];
+  snprintf(millis, sizeof(millis), ".%03u", now.nsec / 1000000);
+  const std::string prefix = flight_recorder_prefix_.empty() ?
+    defaultFilePrefix() + "_flight" : flight_recorder_prefix_;
+  const std::string file_name = prefix + "-" + stamp + millis + ".trace";
+
+  FILE *file = fopen(file_name.c_str(), "wb");
+  if (!file) {
+    ROS_ERROR("swri_profiler: Failed to open flight recording '%s'.", file_name.c_str());
+    return std::string();
+  }
+
+  // The recording has every label, so it can be read without the
+  // node's index.
+  writeTraceHeader(file);
+  size_t labels_written = 0;
+  writeTraceLabels(file, labels_written);
+
+  const int64_t start_ns = now.toNSec() - flight_recorder_duration_ns_;
+  for (auto &recording : recordings) {
+    std::vector<TraceEvent> &events = recording.second;
+    for (auto &event : events) {
+      event.time = Clock::toWallTime(event.time).toNSec();
+    }
+    events.erase(events.begin(),
+                 std::find_if(events.begin(), events.end(),
+                              [start_ns](const TraceEvent &e) { return e.time >= start_ns; }));
+    if (events.empty()) {
+      continue;
+    }
+
+    struct
+    {
+      uint32_t thread_id;
+      uint32_t padding;
+      uint64_t dropped;
+    } header = { recording.first, 0, 0 };
+    writeTraceChunk(file, TRACE_CHUNK_EVENTS,
+                    &header, sizeof(header),
+                    events.data(), events.size() * sizeof(TraceEvent));
+  }
+
+  const bool failed = ferror(file) != 0;
+  if (fclose(file) != 0 || failed) {
+    ROS_ERROR("swri_profiler: Failed to write flight recording '%s'.", file_name.c_str());
+    return std::string();
+  }
+  return file_name;
+}
+
+void Profiler::flightMain()
+{
+  ROS_DEBUG("swri_profiler flight recorder thread started.");
+  while (ros::ok()) {
+    waitSemaphore(flight_semaphore_, 100000000);
+    const int requests = flight_requests_.exchange(0, std::memory_order_acq_rel);
+    if (requests == 0) {
+      continue;
+    }
+
+    const char *reason = "SIGUSR2";
+    if (!(requests & FLIGHT_REQUEST_SIGNAL)) {
+      const int64_t now_ns = ros::WallTime::now().toNSec();
+      if (last_overrun_recording_ns_ != 0 &&
+          now_ns - last_overrun_recording_ns_ < flight_recorder_duration_ns_) {
+        continue;
+      }
+      last_overrun_recording_ns_ = now_ns;
+      reason = "a budget overrun";
+    }
+
+    const std::string file_name = dumpFlightRecording();
+    if (!file_name.empty()) {
+      ROS_INFO("swri_profiler: Wrote flight recording '%s' after %s.", file_name.c_str(), reason);
+    }
+  }
+  ROS_DEBUG("swri_profiler flight recorder thread stopped.");
+}
+
+void Profiler::reportOverrun(TLS &tls, size_t node, int64_t time,
+                             int64_t duration_ns, int64_t budget_ns)
+{
+  Overrun overrun;
+  overrun.time = time;
+  overrun.duration_ns = duration_ns;
+  overrun.budget_ns = budget_ns;
+  overrun.node = node;
+  overrun.thread_id = tls.thread_id;
+  tls.overruns.push(overrun);
+  if (!overrun_pending_.exchange(true, std::memory_order_acq_rel)) {
+    sem_post(&overrun_semaphore_);
+  }
+}
+
+void Profiler::overrunMain()
+{
+  ROS_DEBUG("swri_profiler overrun thread started.");
+  std::vector<Overrun> overruns;
+  uint64_t dropped = 0;
+  double tokens = std::max(1.0, overrun_rate_);
+  ros::WallTime last_refill = ros::WallTime::now();
+  while (ros::ok()) {
+    // Wake up now and then to check for shutdown.
+    waitSemaphore(overrun_semaphore_, 100000000);
+
+    // Clear the flag before draining, so that an overrun pushed after
+    // we've looked at its thread posts the semaphore again.
+    if (!overrun_pending_.exchange(false, std::memory_order_acq_rel)) {
+      continue;
+    }
+
+    overruns.clear();
+    {
+      std::lock_guard<std::mutex> overrun_guard(overrun_mutex_);
+      std::vector<TLS*> threads;
+      {
+        SpinLockGuard guard(lock_);
+        threads = all_tls_;
+      }
+      for (TLS *tls : threads) {
+        tls->overruns.drain(overruns);
+        dropped += tls->overruns.takeDropped();
+      }
+    }
+    std::sort(overruns.begin(), overruns.end(),
+              [](const Overrun &a, const Overrun &b) { return a.time < b.time; });
+    if (!overruns.empty() && flight_recorder_on_overrun_ && flight_recorder_events_ != 0) {
+      requestFlightRecording(FLIGHT_REQUEST_OVERRUN);
+    }
+
+    const ros::WallTime now = ros::WallTime::now();
+    const double burst = std::max(1.0, overrun_rate_);
+    tokens = std::min(burst, tokens + (now - last_refill).toSec() * overrun_rate_);
+    last_refill = now;
+
+    for (auto const &overrun : overruns) {
+      if (tokens < 1.0) {
+        dropped++;
+        continue;
+      }
+      tokens -= 1.0;
+
+      spm::ProfileOverrun msg;
+      msg.header.stamp = timeFromWall(Clock::toWallTime(overrun.time));
+      msg.header.frame_id = ros::this_node::getName();
+      msg.label = nodePath(overrun.node);
+      msg.thread_id = overrun.thread_id;
+      msg.duration.fromNSec(overrun.duration_ns);
+      msg.budget.fromNSec(overrun.budget_ns);
+      msg.dropped = dropped;
+      dropped = 0;
+      profiler_overrun_pub_.publish(msg);
+    }
+  }
+  ROS_DEBUG("swri_profiler overrun thread stopped.");
+}
+
+void Profiler::traceMain()
+{
+  ROS_DEBUG("swri_profiler trace thread started.");
+  while (ros::ok()) {
+    ros::WallDuration(trace_drain_period_).sleep();
+
+    // trace_mutex_ is taken first so that the publisher can't free a
+    // thread's storage while we are using it.
+    std::lock_guard<std::mutex> trace_guard(trace_mutex_);
+    std::vector<TLS*> threads;
+    {
+      SpinLockGuard guard(lock_);
+      threads = all_tls_;
+    }
+    for (TLS *tls : threads) {
+      drainTrace(*tls);
+    }
+    if (trace_file_) {
+      fflush(trace_file_);
+    }
+  }
+  ROS_DEBUG("swri_profiler trace thread stopped.");
+}
+
+void Profiler::harvestClosedBlocks(ClosedTable &dst, ClosedTable &src)
+{
+  for (size_t node : src.touched) {
+    ClosedInfo &src_info = src.blocks[node];
+    if (node >= dst.blocks.size()) {
+      dst.blocks.resize(node+1);
+    }
+    auto &dst_info = dst.blocks[node];
+    if (dst_info.count == 0 && dst_info.untimed_count == 0) {
+      dst.touched.push_back(node);
+    }
+
+    dst_info.count += src_info.count;
+    dst_info.untimed_count += src_info.untimed_count;
+    dst_info.total_duration += src_info.total_duration;
+    dst_info.rel_duration += src_info.rel_duration;
+    dst_info.max_duration = std::max(dst_info.max_duration, src_info.max_duration);
+    dst_info.alloc_count += src_info.alloc_count;
+    dst_info.alloc_bytes += src_info.alloc_bytes;
+    dst_info.free_count += src_info.free_count;
+    dst_info.items += src_info.items;
+    dst_info.bytes += src_info.bytes;
+    dst_info.cpu_count += src_info.cpu_count;
+    dst_info.cpu_duration += src_info.cpu_duration;
+    dst_info.perf_count += src_info.perf_count;
+    for (size_t i = 0; i < PerfCounters::size(); i++) {
+      dst_info.perf_counts[i] += src_info.perf_counts[i];
+    }
+    for (size_t i = 0; i < src_info.exemplar_count; i++) {
+      dst_info.addExemplar(src_info.exemplars[i], exemplars_per_block_);
+    }
+    if (src_info.histogram) {
+      if (!dst_info.histogram) {
+        dst_info.histogram.reset(new LatencyHistogram());
+      }
+      dst_info.histogram->merge(*src_info.histogram);
+    }
+    src_info.reset();
+  }
+  src.touched.clear();
+}
+
+// Applies changes to the ~profiler/enabled,
+// ~profiler/trace_enabled and ~profiler/disabled_labels parameters.
+// Settings are only applied when the parameters change so that they
+// don't fight with Profiler::setEnabled() calls made by the node
+// itself.
+static void updateEnableParameters(ros::NodeHandle &pnh)
+{
+  static bool last_enabled = true;
+  static bool last_trace_enabled = Profiler::isTraceEnabled();
+  static std::vector<std::string> last_disabled_labels;
+
+  bool enabled;
+  if (pnh.getParamCached("profiler/enabled", enabled) && enabled != last_enabled) {
+    ROS_INFO("swri_profiler: %s profiler.", enabled ? "Enabling" : "Disabling");
+    Profiler::setEnabled(enabled);
+    last_enabled = enabled;
+  }
+
+  bool trace_enabled;
+  if (pnh.getParamCached("profiler/trace_enabled", trace_enabled) &&
+      trace_enabled != last_trace_enabled) {
+    ROS_INFO("swri_profiler: %s trace mode.", trace_enabled ? "Enabling" : "Disabling");
+    Profiler::setTraceEnabled(trace_enabled);
+    last_trace_enabled = trace_enabled;
+  }
+
+  std::vector<std::string> disabled_labels;
+  if (!pnh.getParamCached("profiler/disabled_labels", disabled_labels)) {
+    disabled_labels.clear();
+  }
+  if (disabled_labels != last_disabled_labels) {
+    for (auto const &prefix : last_disabled_labels) {
+      if (std::find(disabled_labels.begin(), disabled_labels.end(), prefix) ==
+          disabled_labels.end()) {
+        Profiler::setLabelsEnabled(prefix, true);
+      }
+    }
+    for (auto const &prefix : disabled_labels) {
+      Profiler::setLabelsEnabled(prefix, false);
+    }
+    last_disabled_labels = disabled_labels;
+  }
+}
+
+void Profiler::calibrateOverhead()
+{
+  // We time loops of empty blocks on this thread.  They are recorded
+  // like any other block, so we harvest and discard them before the
+  // publisher can see them.  The first run warms up the caches and
+  // interns the calibration node, and we keep the fastest of the
+  // others to avoid counting preemption.
+  const Label &label = *internLabel("swri_profiler_calibration");
+  if (!tls_.get()) { initializeTLS(); }
+  TLS &tls = *tls_;
+  // Tracing the calibration would only waste a trace buffer.
+  tls.trace_unavailable = true;
+
+  const int iterations = 10000;
+  double best_per_call = std::numeric_limits<double>::max();
+  double best_bias = 0.0;
+  for (int run = 0; run < 4; run++) {
+    const int64_t t0 = Clock::now();
+    for (int i = 0; i < iterations; i++) {
+      if (open(label, 1)) {
+        close(label);
+      }
+    }
+    const int64_t t1 = Clock::now();
+
+    ClosedTable blocks;
+    harvestClosedBlocks(blocks, tls.closed_blocks[0]);
+    harvestClosedBlocks(blocks, tls.closed_blocks[1]);
+    size_t count = 0;
+    int64_t total_duration = 0;
+    for (size_t node : blocks.touched) {
+      count += blocks.blocks[node].count;
+      total_duration += blocks.blocks[node].total_duration;
+    }
+
+    const double per_call = static_cast<double>(t1 - t0) / iterations;
+    if (run > 0 && count == static_cast<size_t>(iterations) && per_call < best_per_call) {
+      best_per_call = per_call;
+      best_bias = static_cast<double>(total_duration) / count;
+    }
+  }
+
+  if (best_per_call == std::numeric_limits<double>::max()) {
+    ROS_WARN("swri_profiler: Failed to measure the profiler's overhead.");
+    return;
+  }
+  overhead_per_call_ = best_per_call;
+  overhead_bias_ = std::min(best_bias, best_per_call);
+  ROS_INFO("swri_profiler: Overhead is %ld ns per block, %ld ns of which is inside the block.",
+           static_cast<long>(Clock::toNanoseconds(overhead_per_call_)),
+           static_cast<long>(Clock::toNanoseconds(overhead_bias_)));
+}
+
 void Profiler::profilerMain()
 {
   ROS_DEBUG("swri_profiler thread started.");
-  while (ros::ok()) {
-    // Align updates to approximately every second.
+  std::unique_ptr<ros::NodeHandle> pnh;
+  if (!standalone_) {
+    pnh.reset(new ros::NodeHandle("~"));
+  }
+  calibrateOverhead();
+  while (publisherRunning()) {
+    // Align updates to the next multiple of the publishing period.
     ros::WallTime now = ros::WallTime::now();
-    ros::WallTime next(now.sec+1,0);
+    ros::WallTime next;
+    next.fromNSec((now.toNSec() / publish_period_ns_ + 1) * publish_period_ns_);
     (next-now).sleep();
+    if (pnh) {
+      updateEnableParameters(*pnh);
+    }
     collectAndPublish();
   }
   
   ROS_DEBUG("swri_profiler thread stopped.");
 }
 
+// A copy of a timed block that was still running during an update.
+// Its relative duration starts at last_report_time.
+struct OpenBlock
+{
+  size_t node;
+  int64_t t0;
+  int64_t last_report_time;
+};
+
 void Profiler::collectAndPublish()
 {
-  static bool first_run = true;
-  static ros::WallTime last_now = ros::WallTime::now();
-  
-  // Grab a snapshot of the current state.  
-  std::unordered_map<std::string, ClosedInfo> new_closed_blocks;
-  std::unordered_map<std::string, OpenInfo> threaded_open_blocks;
+  // Grab a snapshot of the current state.  new_closed_blocks is kept
+  // between updates so that its storage is reused, and only the nodes
+  // in its touched list are visited, so the cost of an update depends
+  // on the number of active blocks rather than on every block ever
+  // seen.
+  static ClosedTable new_closed_blocks;
+  std::vector<OpenBlock> threaded_open_blocks;
+  std::vector<size_t> open_nodes;
+  const int64_t now_ticks = Clock::now();
   ros::WallTime now = ros::WallTime::now();
   ros::Time ros_now = ros::Time::now();  
+  const int64_t now_ns = now.toNSec();
+
+  std::vector<TLS*> threads;
   {
     SpinLockGuard guard(lock_);
-    new_closed_blocks.swap(closed_blocks_);
-    for (auto &pair : open_blocks_) {
-      threaded_open_blocks[pair.first].t0 = pair.second.t0;
-      pair.second.last_report_time = now;
+    threads = all_tls_;
+  }
+
+  std::vector<TLS*> retired_threads;
+  for (TLS *tls : threads) {
+    if (tls->retired.load(std::memory_order_acquire)) {
+      // The thread has exited, so nothing else can touch either
+      // buffer.
+      harvestClosedBlocks(new_closed_blocks, tls->closed_blocks[0]);
+      harvestClosedBlocks(new_closed_blocks, tls->closed_blocks[1]);
+      retired_threads.push_back(tls);
+      continue;
+    }
+
+    // Swap the thread's buffers and wait for it to finish any
+    // recording that may have started before the swap.  Recording a
+    // block only takes a few hundred nanoseconds, so this wait is
+    // short, and it only ever delays the publisher.
+    const int old_active = tls->active.load(std::memory_order_relaxed);
+    tls->active.store(1 - old_active, std::memory_order_seq_cst);
+    const uint64_t epoch = tls->epoch.load(std::memory_order_seq_cst);
+    if (epoch & 1) {
+      while (tls->epoch.load(std::memory_order_acquire) == epoch) {
+        std::this_thread::yield();
+      }
+    }
+    harvestClosedBlocks(new_closed_blocks, tls->closed_blocks[old_active]);
+
+    // Read the open blocks like a seqlock, using each frame's
+    // report_time as its sequence number.  A timed block is reported
+    // up to now_ticks only if we can swap in the new report time,
+    // which proves that the call was still open and that the fields
+    // we copied belong to it.  Blocks that opened after now_ticks are
+    // left for the next update.  Those and untimed blocks are only
+    // checked to still be open, so that their nodes count as in use
+    // and aren't evicted from under them.
+    const size_t high_water = tls->open_high_water.load(std::memory_order_acquire);
+    for (size_t i = 1; i <= high_water; i++) {
+      OpenInfo &info = tls->open_blocks[i];
+      int64_t report_time = info.report_time.load(std::memory_order_acquire);
+      if (report_time == closed_report_time_) {
+        continue;
+      }
+      OpenBlock block;
+      block.node = info.node;
+      block.t0 = info.t0;
+      const bool timed = info.timed;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (timed && block.t0 < now_ticks) {
+        block.last_report_time = std::max(block.t0, report_time);
+        if (!info.report_time.compare_exchange_strong(
+              report_time, now_ticks, std::memory_order_acq_rel)) {
+          continue;
+        }
+        threaded_open_blocks.push_back(block);
+      } else if (info.report_time.load(std::memory_order_relaxed) != report_time) {
+        continue;
+      }
+      open_nodes.push_back(block.node);
     }
   }
 
-  // Reset all relative max durations.
-  for (auto &pair : all_closed_blocks_) {
-    pair.second.rel_total_duration = ros::Duration(0);
-    pair.second.rel_max_duration = ros::Duration(0);
+  if (!retired_threads.empty()) {
+    std::lock_guard<std::mutex> trace_guard(trace_mutex_);
+    std::lock_guard<std::mutex> overrun_guard(overrun_mutex_);
+    for (TLS *tls : retired_threads) {
+      releaseTrace(*tls);
+    }
+
+    SpinLockGuard guard(lock_);
+    for (TLS *tls : retired_threads) {
+      all_tls_.erase(std::find(all_tls_.begin(), all_tls_.end(), tls));
+      delete tls->flight.load(std::memory_order_relaxed);
+      tls->~TLS();
+      free(tls);
+    }
   }
 
+  // Reset the relative fields of the blocks reported last time.
+  for (size_t node : reported_nodes_) {
+    auto &item = all_closed_blocks_[node];
+    item.rel_call_count = 0;
+    item.rel_timed_call_count = 0;
+    item.rel_total_duration = ros::Duration(0);
+    item.rel_max_duration = ros::Duration(0);
+    item.rel_p50_duration = ros::Duration(0);
+    item.rel_p90_duration = ros::Duration(0);
+    item.rel_p99_duration = ros::Duration(0);
+    item.rel_p999_duration = ros::Duration(0);
+    item.rel_overhead_duration = ros::Duration(0);
+    item.rel_alloc_count = 0;
+    item.rel_alloc_bytes = 0;
+    item.rel_free_count = 0;
+    item.rel_items = 0;
+    item.rel_bytes = 0;
+    item.rel_cpu_duration = ros::Duration(0);
+    item.rel_exclusive_cpu_duration = ros::Duration(0);
+    item.rel_off_cpu_duration = ros::Duration(0);
+    std::fill(item.rel_counters.begin(), item.rel_counters.end(), 0);
+    item.rel_exemplars.clear();
+  }
+  reported_nodes_.clear();
+
+  // Mark the nodes that were used during this interval as active.
+  // Then count the calls made inside each node and sum the CPU time
+  // used by each node's children by walking up from every node that
+  // was called.  CPU time may only have been measured for some of the
+  // calls, so it is scaled up like sampled durations.
+  std::unordered_map<size_t, size_t> descendant_calls;
+  std::unordered_map<size_t, int64_t> cpu_durations;
+  std::unordered_map<size_t, int64_t> children_cpu_durations;
+  {
+    SpinLockGuard guard(tree_lock_);
+    node_status_.resize(tree_nodes_.size());
+    auto mark_active = [now_ns](size_t node) {
+      NodeStatus &status = node_status_[node];
+      if (status.state == NODE_FREE && tree_nodes_[node].label) {
+        status.state = NODE_LIVE;
+      }
+      status.last_active_ns = now_ns;
+    };
+    for (size_t node : open_nodes) {
+      mark_active(node);
+    }
+
+    for (size_t node : new_closed_blocks.touched) {
+      mark_active(node);
+      if (node_status_[node].state != NODE_LIVE) {
+        continue;
+      }
+
+      const auto &info = new_closed_blocks.blocks[node];
+      const size_t call_count = info.count + info.untimed_count;
+      int64_t cpu_duration = 0;
+      if (info.cpu_count > 0) {
+        cpu_duration = static_cast<int64_t>(
+          static_cast<double>(info.cpu_duration) * call_count / info.cpu_count);
+        cpu_durations[node] = cpu_duration;
+      }
+      const size_t parent = tree_nodes_[node].parent;
+      children_cpu_durations[parent] += cpu_duration;
+      for (size_t ancestor = parent; ancestor != 0; ancestor = tree_nodes_[ancestor].parent) {
+        descendant_calls[ancestor] += call_count;
+      }
+    }
+  }
+  size_t total_calls = 0;
+
   // Flag to indicate if a new item was added.
   bool update_index = false;
 
   // Merge the new stats into the absolute stats
-  for (auto const &pair : new_closed_blocks) {
-    const auto &label = pair.first;
-    const auto &new_info = pair.second;
+  for (size_t node : new_closed_blocks.touched) {
+    const auto &new_info = new_closed_blocks.blocks[node];
+    const size_t call_count = new_info.count + new_info.untimed_count;
+    if (call_count == 0 || node_status_[node].state != NODE_LIVE) {
+      // Anything recorded to an evicted node is dropped.
+      continue;
+    }
 
-    auto &all_info = all_closed_blocks_[label];
+    // Sampled blocks only timed some of their calls, so we scale
+    // their durations up to estimate the time spent in all of them.
+    int64_t total_duration = new_info.total_duration;
+    int64_t rel_duration = new_info.rel_duration;
+    if (new_info.untimed_count > 0 && new_info.count > 0) {
+      const double scale = static_cast<double>(call_count) / new_info.count;
+      total_duration = static_cast<int64_t>(total_duration * scale);
+      rel_duration = static_cast<int64_t>(rel_duration * scale);
+    }
 
-    if (all_info.key == 0) {
-      update_index = true;
-      all_info.key = all_closed_blocks_.size();
+    // Each call includes its own share of the profiler's overhead,
+    // plus the full overhead of every call nested inside it.
+    const auto descendants = descendant_calls.find(node);
+    const size_t nested_calls = descendants == descendant_calls.end() ? 0 : descendants->second;
+    const int64_t overhead = static_cast<int64_t>(
+      call_count * overhead_bias_ + nested_calls * overhead_per_call_);
+    total_calls += call_count;
+    if (subtract_overhead_) {
+      total_duration = std::max<int64_t>(0, total_duration - overhead);
+      rel_duration = std::max<int64_t>(0, rel_duration - overhead);
     }
-    
-    all_info.abs_call_count += new_info.count;
-    all_info.abs_total_duration += durationFromWall(new_info.total_duration);
-    all_info.rel_total_duration += durationFromWall(new_info.rel_duration);
+
+    auto &all_info = touchReportedNode(node, update_index);
+    reported_nodes_.push_back(node);
+    all_info.rel_overhead_duration = durationFromTicks(overhead);
+    all_info.abs_overhead_duration += durationFromTicks(overhead);
+    all_info.abs_call_count += call_count;
+    all_info.rel_call_count = call_count;
+    all_info.rel_timed_call_count = new_info.count;
+    all_info.abs_total_duration += durationFromTicks(total_duration);
+    all_info.rel_total_duration += durationFromTicks(rel_duration);
     all_info.rel_max_duration = std::max(all_info.rel_max_duration,
-                                         durationFromWall(new_info.max_duration));
+                                         durationFromTicks(new_info.max_duration));
+    all_info.rel_alloc_count = new_info.alloc_count;
+    all_info.rel_alloc_bytes = new_info.alloc_bytes;
+    all_info.rel_free_count = new_info.free_count;
+    all_info.abs_alloc_count += new_info.alloc_count;
+    all_info.abs_alloc_bytes += new_info.alloc_bytes;
+    all_info.rel_items = new_info.items;
+    all_info.rel_bytes = new_info.bytes;
+    all_info.abs_items += new_info.items;
+    all_info.abs_bytes += new_info.bytes;
+
+    if (new_info.cpu_count > 0) {
+      const int64_t cpu_duration = cpu_durations[node];
+      all_info.rel_cpu_duration.fromNSec(cpu_duration);
+      all_info.rel_exclusive_cpu_duration.fromNSec(
+        std::max<int64_t>(0, cpu_duration - children_cpu_durations[node]));
+      all_info.rel_off_cpu_duration.fromNSec(
+        std::max<int64_t>(0, Clock::toNanoseconds(total_duration) - cpu_duration));
+      all_info.abs_cpu_duration += all_info.rel_cpu_duration;
+    }
+
+    // Perf counts are scaled up from the calls that read them, like
+    // sampled durations.
+    if (new_info.perf_count > 0) {
+      const size_t counters = PerfCounters::size();
+      all_info.rel_counters.resize(counters, 0);
+      all_info.abs_counters.resize(counters, 0);
+      const double scale = static_cast<double>(call_count) / new_info.perf_count;
+      for (size_t i = 0; i < counters; i++) {
+        all_info.rel_counters[i] = static_cast<uint64_t>(new_info.perf_counts[i] * scale);
+        all_info.abs_counters[i] += all_info.rel_counters[i];
+      }
+    }
+
+    // The histogram buckets are only approximate, so clamp the
+    // percentiles to the maximum to keep them consistent.
+    if (new_info.histogram) {
+      const LatencyHistogram &histogram = *new_info.histogram;
+      all_info.rel_p50_duration = durationFromTicks(
+        std::min(histogram.quantile(0.5), new_info.max_duration));
+      all_info.rel_p90_duration = durationFromTicks(
+        std::min(histogram.quantile(0.9), new_info.max_duration));
+      all_info.rel_p99_duration = durationFromTicks(
+        std::min(histogram.quantile(0.99), new_info.max_duration));
+      all_info.rel_p999_duration = durationFromTicks(
+        std::min(histogram.quantile(0.999), new_info.max_duration));
+    }
+
+    // The exemplars are published slowest first.
+    std::vector<Exemplar> exemplars(new_info.exemplars,
+                                    new_info.exemplars + new_info.exemplar_count);
+    std::sort_heap(exemplars.begin(), exemplars.end(), Exemplar::faster);
+    all_info.rel_exemplars.resize(exemplars.size());
+    for (size_t i = 0; i < exemplars.size(); i++) {
+      spm::ProfileExemplar &exemplar = all_info.rel_exemplars[i];
+      exemplar.start = timeFromWall(Clock::toWallTime(exemplars[i].t0));
+      exemplar.duration = durationFromTicks(exemplars[i].duration);
+      exemplar.thread_id = exemplars[i].thread_id;
+    }
   }
+
+  for (size_t node : new_closed_blocks.touched) {
+    new_closed_blocks.blocks[node].reset();
+  }
+  new_closed_blocks.touched.clear();
   
   // Combine the open blocks from all threads into a single
   // map.
-  std::unordered_map<std::string, spm::ProfileData> combined_open_blocks;
-  for (auto const &pair : threaded_open_blocks) {
-    const auto &threaded_label = pair.first;
-    const auto &threaded_info = pair.second;
-
-    size_t slash_index = threaded_label.find('/');
-    if (slash_index == std::string::npos) {
-      ROS_ERROR("Missing expected slash in label: %s", threaded_label.c_str());
+  std::unordered_map<size_t, spm::ProfileData> combined_open_blocks;
+  for (auto const &threaded_info : threaded_open_blocks) {
+    ros::Duration duration = durationFromTicks(now_ticks - threaded_info.t0);
+    ros::Duration rel_duration = durationFromTicks(now_ticks - threaded_info.last_report_time);
+    
+    const size_t node = threaded_info.node;
+    if (node_status_[node].state != NODE_LIVE) {
       continue;
     }
-
-    ros::Duration duration = durationFromWall(now - threaded_info.t0);
-    
-    const auto label = threaded_label.substr(slash_index+1);
-    auto &new_info = combined_open_blocks[label];
+    auto &new_info = combined_open_blocks[node];
 
     if (new_info.key == 0) {
-      auto &all_info = all_closed_blocks_[label];
-      if (all_info.key == 0) {
-        update_index = true;
-        all_info.key = all_closed_blocks_.size();
-      }
-      new_info.key = all_info.key;
+      new_info.key = touchReportedNode(node, update_index).key;
     }
 
     new_info.abs_call_count++;
     new_info.abs_total_duration += duration;
-    if (first_run) {
-      new_info.rel_total_duration += duration;
-    } else {
-      new_info.rel_total_duration += std::min(
-        durationFromWall(now - last_now), duration);
-    }
+    new_info.rel_total_duration += rel_duration;
     new_info.rel_max_duration = std::max(new_info.rel_max_duration, duration);
   }
 
+  // Evicted nodes are released once a whole update has passed without
+  // anything using them.  The scan for idle nodes visits every node,
+  // so it only runs a few times per idle period.
+  {
+    SpinLockGuard guard(tree_lock_);
+    for (size_t i = 0; i < evicted_nodes_.size(); ) {
+      const size_t node = evicted_nodes_[i];
+      if (node_status_[node].last_active_ns < now_ns) {
+        node_status_[node].state = NODE_FREE;
+        free_nodes_.push_back(node);
+        evicted_nodes_[i] = evicted_nodes_.back();
+        evicted_nodes_.pop_back();
+      } else {
+        i++;
+      }
+    }
+  }
+  const int64_t idle_eviction_ns = idle_eviction_ns_.load();
+  if (idle_eviction_ns > 0 && now_ns - last_eviction_scan_ns_ >= idle_eviction_ns / 4) {
+    last_eviction_scan_ns_ = now_ns;
+    evictIdleNodes(now_ns, update_index);
+  }
+
   if (update_index) {
     spm::ProfileIndexArray index;
     index.header.stamp = timeFromWall(now);
     index.header.frame_id = ros::this_node::getName();
-    index.data.resize(all_closed_blocks_.size());
+    index.counter_names = PerfCounters::names();
     
-    for (auto const &pair : all_closed_blocks_) {
-      size_t i = pair.second.key - 1;
-      index.data[i].key = pair.second.key;
-      index.data[i].label = pair.first;
+    for (size_t node = 0; node < all_closed_blocks_.size(); node++) {
+      if (all_closed_blocks_[node].key == 0) {
+        continue;
+      }
+      index.data.emplace_back();
+      index.data.back().key = all_closed_blocks_[node].key;
+      index.data.back().label = node_paths_[node];
     }        
-    profiler_index_pub_.publish(index);
+    if (!standalone_) {
+      profiler_index_pub_.publish(index);
+    }
   }
 
   // Generate output message
@@ -193,32 +1865,78 @@ void Profiler::collectAndPublish()
   msg.header.stamp = timeFromWall(now);
   msg.header.frame_id = ros::this_node::getName();
   msg.rostime_stamp = ros_now;
-  
-  msg.data.resize(all_closed_blocks_.size());
-  for (auto &pair : all_closed_blocks_) {
-    auto const &item = pair.second;
-    size_t i = item.key - 1;
-
-    msg.data[i].key = item.key;
-    msg.data[i].abs_call_count = item.abs_call_count;
-    msg.data[i].abs_total_duration = item.abs_total_duration;
-    msg.data[i].rel_total_duration = item.rel_total_duration;
-    msg.data[i].rel_max_duration = item.rel_max_duration;
-  }
-
-  for (auto &pair : combined_open_blocks) {
-    auto const &item = pair.second;
-    size_t i = item.key - 1;
-    msg.data[i].abs_call_count += item.abs_call_count;
-    msg.data[i].abs_total_duration += item.abs_total_duration;
-    msg.data[i].rel_total_duration += item.rel_total_duration;
-    msg.data[i].rel_max_duration = std::max(
-      msg.data[i].rel_max_duration,
-      item.rel_max_duration);
+  msg.period.fromNSec(publish_period_ns_);
+  msg.overhead_per_call = durationFromTicks(overhead_per_call_);
+  msg.overhead_bias = durationFromTicks(overhead_bias_);
+  msg.rel_overhead_duration = durationFromTicks(total_calls * overhead_per_call_);
+  msg.overhead_corrected = subtract_overhead_;
+  msg.sequence = window_sequence_++;
+  msg.keyframe = msg.sequence % keyframe_interval_ == 0;
+
+  // Blocks that weren't called and aren't running have nothing new to
+  // report, so they are only sent in keyframes.
+  std::vector<size_t> nodes;
+  if (msg.keyframe) {
+    for (size_t node = 0; node < all_closed_blocks_.size(); node++) {
+      if (all_closed_blocks_[node].key != 0) {
+        nodes.push_back(node);
+      }
+    }
+  } else {
+    nodes = reported_nodes_;
+    for (auto const &pair : combined_open_blocks) {
+      nodes.push_back(pair.first);
+    }
+    std::sort(nodes.begin(), nodes.end());
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+  }
+
+  // Open blocks are added to the closed blocks' data.
+  for (size_t node : nodes) {
+    msg.data.push_back(all_closed_blocks_[node]);
+    auto const open = combined_open_blocks.find(node);
+    if (open != combined_open_blocks.end()) {
+      addOpenBlock(msg.data.back(), open->second);
+    }
+  }
+
+  // The shared memory segment always holds every block, since readers
+  // may skip any number of windows.
+  {
+    std::lock_guard<std::mutex> guard(shared_memory_mutex_);
+    if (shared_memory_ && shared_memory_->isOpen()) {
+      shared_memory_->beginUpdate(now.toNSec(), publish_period_ns_,
+                                  update_index || shared_memory_labels_changed_,
+                                  PerfCounters::names());
+      shared_memory_labels_changed_ = false;
+      for (size_t node = 0; node < all_closed_blocks_.size(); node++) {
+        if (all_closed_blocks_[node].key == 0) {
+          continue;
+        }
+        auto const open = combined_open_blocks.find(node);
+        if (open == combined_open_blocks.end()) {
+          shared_memory_->addBlock(sharedMemoryBlock(all_closed_blocks_[node]), node_paths_[node]);
+        } else {
+          spm::ProfileData data = all_closed_blocks_[node];
+          addOpenBlock(data, open->second);
+          shared_memory_->addBlock(sharedMemoryBlock(data), node_paths_[node]);
+        }
+      }
+      shared_memory_->endUpdate();
+    }
+  }
+
+  if (standalone_) {
+    // There is nowhere to publish to.
+  } else if (windows_per_message_ == 1) {
+    profiler_data_pub_.publish(msg);
+  } else {
+    pending_windows_.windows.push_back(msg);
+    if (pending_windows_.windows.size() >= static_cast<size_t>(windows_per_message_)) {
+      pending_windows_.header = msg.header;
+      profiler_data_batch_pub_.publish(pending_windows_);
+      pending_windows_.windows.clear();
+    }
   }
-  
-  profiler_data_pub_.publish(msg);
-  first_run = false;
-  last_now = now;
 }
 }  // namespace swri_profiler
@@ -0,0 +1,321 @@
+#include <swri_profiler/shared_memory.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ros/console.h>
+
+namespace swri_profiler
+{
+// Rounds up so that the block array stays 8-byte aligned.
+static size_t align8(size_t size)
+{
+  return (size + 7) & ~static_cast<size_t>(7);
+}
+
+static void copyName(char *dst, size_t dst_size, const std::string &src)
+{
+  const size_t size = std::min(src.size(), dst_size - 1);
+  std::memcpy(dst, src.data(), size);
+  dst[size] = '\0';
+}
+
+SharedMemoryWriter::SharedMemoryWriter()
+  :
+  data_(NULL),
+  size_(0),
+  header_(NULL),
+  blocks_(NULL),
+  string_table_(NULL),
+  sequence_(0)
+{
+}
+
+SharedMemoryWriter::~SharedMemoryWriter()
+{
+  close();
+}
+
+bool SharedMemoryWriter::open(const std::string &name,
+                              const std::string &node_name,
+                              size_t max_blocks,
+                              size_t string_table_size)
+{
+  close();
+
+  const size_t blocks_offset = align8(sizeof(SharedMemoryHeader));
+  const size_t string_table_offset = blocks_offset + max_blocks*sizeof(SharedMemoryBlock);
+  const size_t size = string_table_offset + string_table_size;
+  if (size > UINT32_MAX) {
+    ROS_ERROR("swri_profiler: Shared memory segment would be too large (%zu bytes).", size);
+    return false;
+  }
+
+  // A segment left by a process that crashed with the same pid is
+  // replaced.
+  shm_unlink(name.c_str());
+  const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    ROS_ERROR("swri_profiler: Failed to create shared memory segment %s: %s",
+              name.c_str(), strerror(errno));
+    return false;
+  }
+  if (ftruncate(fd, size) != 0) {
+    ROS_ERROR("swri_profiler: Failed to size shared memory segment %s: %s",
+              name.c_str(), strerror(errno));
+    ::close(fd);
+    shm_unlink(name.c_str());
+    return false;
+  }
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    ROS_ERROR("swri_profiler: Failed to map shared memory segment %s: %s",
+              name.c_str(), strerror(errno));
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  name_ = name;
+  data_ = data;
+  size_ = size;
+  char *bytes = static_cast<char*>(data_);
+  blocks_ = reinterpret_cast<SharedMemoryBlock*>(bytes + blocks_offset);
+  string_table_ = bytes + string_table_offset;
+  labels_.clear();
+  sequence_ = 0;
+
+  // The segment is zero filled, so readers see an empty, even
+  // sequence until the magic number is written.
+  header_ = new (data_) SharedMemoryHeader();
+  header_->version = shared_memory_version_;
+  header_->pid = getpid();
+  header_->max_blocks = max_blocks;
+  header_->blocks_offset = blocks_offset;
+  header_->string_table_offset = string_table_offset;
+  header_->string_table_size = string_table_size;
+  copyName(header_->node_name, sizeof(header_->node_name), node_name);
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(header_->magic, shared_memory_magic_, sizeof(header_->magic));
+
+  ROS_INFO("swri_profiler: Exporting to shared memory segment %s (%zu bytes).",
+           name.c_str(), size);
+  return true;
+}
+
+void SharedMemoryWriter::close()
+{
+  if (!data_) {
+    return;
+  }
+  munmap(data_, size_);
+  shm_unlink(name_.c_str());
+  data_ = NULL;
+  size_ = 0;
+  header_ = NULL;
+  blocks_ = NULL;
+  string_table_ = NULL;
+  labels_.clear();
+}
+
+void SharedMemoryWriter::unlink()
+{
+  if (data_) {
+    shm_unlink(name_.c_str());
+  }
+}
+
+void SharedMemoryWriter::beginUpdate(int64_t stamp_ns,
+                                     int64_t period_ns,
+                                     bool labels_changed,
+                                     const std::vector<std::string> &counter_names)
+{
+  sequence_++;
+  header_->sequence.store(sequence_, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  header_->stamp_ns = stamp_ns;
+  header_->period_ns = period_ns;
+  header_->block_count = 0;
+  header_->counter_count = std::min(counter_names.size(), shared_memory_max_counters_);
+  for (size_t i = 0; i < header_->counter_count; i++) {
+    copyName(header_->counter_names[i], sizeof(header_->counter_names[i]), counter_names[i]);
+  }
+
+  if (labels_changed) {
+    labels_.clear();
+    header_->string_table_used = 0;
+  }
+}
+
+void SharedMemoryWriter::addBlock(const SharedMemoryBlock &block, const std::string &label)
+{
+  if (header_->block_count >= header_->max_blocks) {
+    return;
+  }
+
+  auto it = labels_.find(block.key);
+  if (it == labels_.end()) {
+    std::pair<uint32_t, uint32_t> location(header_->string_table_used, 0);
+    if (label.size() <= header_->string_table_size - header_->string_table_used) {
+      std::memcpy(string_table_ + location.first, label.data(), label.size());
+      location.second = label.size();
+      header_->string_table_used += label.size();
+    }
+    it = labels_.insert(std::make_pair(block.key, location)).first;
+  }
+
+  SharedMemoryBlock &dst = blocks_[header_->block_count++];
+  dst = block;
+  dst.label_offset = it->second.first;
+  dst.label_size = it->second.second;
+}
+
+void SharedMemoryWriter::endUpdate()
+{
+  sequence_++;
+  header_->sequence.store(sequence_, std::memory_order_release);
+}
+
+SharedMemoryReader::SharedMemoryReader()
+  :
+  data_(NULL),
+  size_(0)
+{
+}
+
+SharedMemoryReader::~SharedMemoryReader()
+{
+  close();
+}
+
+std::vector<std::string> SharedMemoryReader::list()
+{
+  std::vector<std::string> names;
+  DIR *dir = opendir("/dev/shm");
+  if (!dir) {
+    return names;
+  }
+  const std::string prefix = "swri_profiler.";
+  while (struct dirent *entry = readdir(dir)) {
+    if (std::strncmp(entry->d_name, prefix.c_str(), prefix.size()) == 0) {
+      names.push_back(std::string("/") + entry->d_name);
+    }
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+bool SharedMemoryReader::open(const std::string &name)
+{
+  close();
+
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(SharedMemoryHeader))) {
+    ::close(fd);
+    return false;
+  }
+  void *data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  data_ = data;
+  size_ = info.st_size;
+  return true;
+}
+
+void SharedMemoryReader::close()
+{
+  if (!data_) {
+    return;
+  }
+  munmap(data_, size_);
+  data_ = NULL;
+  size_ = 0;
+}
+
+bool SharedMemoryReader::read(SharedMemorySnapshot &snapshot) const
+{
+  if (!data_) {
+    return false;
+  }
+  const char *bytes = static_cast<const char*>(data_);
+  const SharedMemoryHeader *header = static_cast<const SharedMemoryHeader*>(data_);
+  if (std::memcmp(header->magic, shared_memory_magic_, sizeof(header->magic)) != 0) {
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (header->version != shared_memory_version_ ||
+      static_cast<size_t>(header->blocks_offset) +
+      static_cast<size_t>(header->max_blocks)*sizeof(SharedMemoryBlock) > header->string_table_offset ||
+      static_cast<size_t>(header->string_table_offset) + header->string_table_size > size_) {
+    return false;
+  }
+
+  // The writer holds the sequence odd for the short time it takes to
+  // rewrite the segment once per window, so give up if it stays odd
+  // much longer than that.
+  for (int attempt = 0; attempt < 1000; attempt++) {
+    const uint64_t sequence = header->sequence.load(std::memory_order_acquire);
+    if (sequence & 1) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    snapshot.pid = header->pid;
+    snapshot.sequence = sequence;
+    snapshot.node_name.assign(header->node_name,
+                              strnlen(header->node_name, sizeof(header->node_name)));
+    snapshot.stamp_ns = header->stamp_ns;
+    snapshot.period_ns = header->period_ns;
+
+    const size_t counter_count = std::min<size_t>(header->counter_count, shared_memory_max_counters_);
+    snapshot.counter_names.resize(counter_count);
+    for (size_t i = 0; i < counter_count; i++) {
+      snapshot.counter_names[i].assign(header->counter_names[i],
+                                       strnlen(header->counter_names[i], sizeof(header->counter_names[i])));
+    }
+
+    const size_t block_count = std::min(header->block_count, header->max_blocks);
+    const SharedMemoryBlock *blocks = reinterpret_cast<const SharedMemoryBlock*>(
+      bytes + header->blocks_offset);
+    snapshot.blocks.assign(blocks, blocks + block_count);
+
+    // Labels are copied after the blocks and checked against the
+    // table size, since a torn read may have garbage offsets.
+    const char *string_table = bytes + header->string_table_offset;
+    const size_t string_table_size = header->string_table_size;
+    snapshot.labels.resize(block_count);
+    for (size_t i = 0; i < block_count; i++) {
+      const SharedMemoryBlock &block = snapshot.blocks[i];
+      if (block.label_offset > string_table_size ||
+          block.label_size > string_table_size - block.label_offset) {
+        snapshot.labels[i].clear();
+        continue;
+      }
+      snapshot.labels[i].assign(string_table + block.label_offset, block.label_size);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header->sequence.load(std::memory_order_relaxed) == sequence) {
+      return true;
+    }
+  }
+  return false;
+}
+}  // namespace swri_profiler
@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <swri_profiler/histogram.h>
+
+namespace sp = swri_profiler;
+typedef sp::LatencyHistogram Histogram;
+
+// A quantile is reported as the midpoint of its bucket, and a bucket
+// is at most 1/sub_buckets_ of its lower bound wide, so the estimate
+// is within half of that of the exact value.
+static void expectQuantileNear(const Histogram &histogram,
+                               std::vector<int64_t> values,
+                               double q)
+{
+  std::sort(values.begin(), values.end());
+  const size_t rank = std::max<size_t>(1, static_cast<size_t>(std::ceil(q * values.size())));
+  const int64_t exact = values[rank - 1];
+  const int64_t estimate = histogram.quantile(q);
+  EXPECT_LE(std::llabs(estimate - exact), exact / (2 * Histogram::sub_buckets_) + 1)
+    << "q = " << q << ", exact = " << exact << ", estimate = " << estimate;
+}
+
+TEST(LatencyHistogram, BucketsCoverEveryValueOnce)
+{
+  for (int i = 0; i + 1 < Histogram::num_buckets_; i++) {
+    const int64_t lower = Histogram::bucketLowerBound(i);
+    const int64_t upper = Histogram::bucketLowerBound(i + 1);
+    ASSERT_LT(lower, upper) << "bucket " << i;
+    EXPECT_EQ(i, Histogram::bucketIndex(lower)) << "bucket " << i;
+    EXPECT_EQ(i, Histogram::bucketIndex(upper - 1)) << "bucket " << i;
+    if (i >= Histogram::sub_buckets_) {
+      EXPECT_LE(upper - lower, lower / Histogram::sub_buckets_) << "bucket " << i;
+    }
+  }
+}
+
+TEST(LatencyHistogram, SmallValuesAreExact)
+{
+  for (int64_t value = 0; value < Histogram::sub_buckets_; value++) {
+    Histogram histogram;
+    histogram.record(value);
+    EXPECT_EQ(value, histogram.quantile(0.5));
+  }
+}
+
+TEST(LatencyHistogram, OutOfRangeValuesAreClamped)
+{
+  EXPECT_EQ(0, Histogram::bucketIndex(-5));
+  EXPECT_EQ(Histogram::num_buckets_ - 1,
+            Histogram::bucketIndex(int64_t(1) << Histogram::max_exponent_));
+  EXPECT_EQ(Histogram::num_buckets_ - 1, Histogram::bucketIndex(INT64_MAX));
+}
+
+TEST(LatencyHistogram, UniformQuantiles)
+{
+  Histogram histogram;
+  std::vector<int64_t> values;
+  for (int64_t value = 1; value <= 1000000; value++) {
+    histogram.record(value);
+    values.push_back(value);
+  }
+  EXPECT_EQ(values.size(), histogram.totalCount());
+  expectQuantileNear(histogram, values, 0.5);
+  expectQuantileNear(histogram, values, 0.99);
+}
+
+TEST(LatencyHistogram, ExponentialQuantiles)
+{
+  std::mt19937 generator(42);
+  std::exponential_distribution<double> distribution(1.0 / 50000.0);
+  Histogram histogram;
+  std::vector<int64_t> values;
+  for (int i = 0; i < 200000; i++) {
+    const int64_t value = static_cast<int64_t>(distribution(generator));
+    histogram.record(value);
+    values.push_back(value);
+  }
+  expectQuantileNear(histogram, values, 0.5);
+  expectQuantileNear(histogram, values, 0.99);
+}
+
+TEST(LatencyHistogram, MergeMatchesRecordingTogether)
+{
+  Histogram a;
+  Histogram b;
+  Histogram both;
+  for (int64_t value = 1; value <= 1000; value++) {
+    (value % 2 ? a : b).record(value * 37);
+    both.record(value * 37);
+  }
+  a.merge(b);
+  EXPECT_EQ(both.totalCount(), a.totalCount());
+  EXPECT_EQ(both.quantile(0.5), a.quantile(0.5));
+  EXPECT_EQ(both.quantile(0.99), a.quantile(0.99));
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
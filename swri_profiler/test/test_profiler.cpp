@@ -0,0 +1,305 @@
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <swri_profiler/profiled_mutex.h>
+#include <swri_profiler/profiler.h>
+#include <swri_profiler/shared_memory.h>
+
+namespace sp = swri_profiler;
+
+// Collects the profiler's data and returns every block by its path.
+// The tests share one profiler, so each uses its own labels, and a
+// block's relative fields cover everything since the previous call.
+static std::map<std::string, sp::SharedMemoryBlock> collect()
+{
+  std::map<std::string, sp::SharedMemoryBlock> blocks;
+  sp::Profiler::collectStandalone();
+
+  sp::SharedMemoryReader reader;
+  sp::SharedMemorySnapshot snapshot;
+  if (!reader.open("/swri_profiler." + std::to_string(getpid())) ||
+      !reader.read(snapshot)) {
+    ADD_FAILURE() << "Failed to read the shared memory segment.";
+    return blocks;
+  }
+  for (size_t i = 0; i < snapshot.blocks.size(); i++) {
+    blocks[snapshot.labels[i]] = snapshot.blocks[i];
+  }
+  return blocks;
+}
+
+TEST(Profiler, DurationsIncludeNestedBlocks)
+{
+  for (int i = 1; i <= 2; i++) {
+    SWRI_PROFILE("outer");
+    sp::Clock::advanceFakeTime(5);
+    {
+      SWRI_PROFILE("inner");
+      sp::Clock::advanceFakeTime(10 * i);
+    }
+    sp::Clock::advanceFakeTime(3);
+  }
+
+  std::map<std::string, sp::SharedMemoryBlock> blocks = collect();
+  ASSERT_EQ(1u, blocks.count("/outer"));
+  ASSERT_EQ(1u, blocks.count("/outer/inner"));
+  EXPECT_EQ(0u, blocks.count("/inner"));
+
+  const sp::SharedMemoryBlock &outer = blocks["/outer"];
+  EXPECT_EQ(2u, outer.rel_call_count);
+  EXPECT_EQ(18 + 28, outer.rel_total_duration_ns);
+  EXPECT_EQ(28, outer.rel_max_duration_ns);
+
+  const sp::SharedMemoryBlock &inner = blocks["/outer/inner"];
+  EXPECT_EQ(2u, inner.rel_call_count);
+  EXPECT_EQ(10 + 20, inner.rel_total_duration_ns);
+  EXPECT_EQ(20, inner.rel_max_duration_ns);
+}
+
+TEST(Profiler, RelativeFieldsCoverOneCollection)
+{
+  for (int i = 0; i < 2; i++) {
+    SWRI_PROFILE("repeated");
+    sp::Clock::advanceFakeTime(4);
+  }
+  std::map<std::string, sp::SharedMemoryBlock> blocks = collect();
+  ASSERT_EQ(1u, blocks.count("/repeated"));
+  EXPECT_EQ(2u, blocks["/repeated"].rel_call_count);
+  EXPECT_EQ(8, blocks["/repeated"].rel_total_duration_ns);
+
+  {
+    SWRI_PROFILE("repeated");
+    sp::Clock::advanceFakeTime(6);
+  }
+  blocks = collect();
+  ASSERT_EQ(1u, blocks.count("/repeated"));
+  EXPECT_EQ(1u, blocks["/repeated"].rel_call_count);
+  EXPECT_EQ(6, blocks["/repeated"].rel_total_duration_ns);
+  EXPECT_EQ(3u, blocks["/repeated"].abs_call_count);
+  EXPECT_EQ(14, blocks["/repeated"].abs_total_duration_ns);
+}
+
+TEST(Profiler, SiblingParentsKeepTheirChildren)
+{
+  for (int i = 0; i < 2; i++) {
+    {
+      SWRI_PROFILE("sibling_a");
+      {
+        SWRI_PROFILE("work");
+        sp::Clock::advanceFakeTime(10);
+      }
+    }
+    {
+      SWRI_PROFILE("sibling_b");
+      {
+        SWRI_PROFILE("work");
+        sp::Clock::advanceFakeTime(20);
+      }
+    }
+  }
+
+  std::map<std::string, sp::SharedMemoryBlock> blocks = collect();
+  ASSERT_EQ(1u, blocks.count("/sibling_a/work"));
+  ASSERT_EQ(1u, blocks.count("/sibling_b/work"));
+  EXPECT_EQ(2u, blocks["/sibling_a/work"].rel_call_count);
+  EXPECT_EQ(20, blocks["/sibling_a/work"].rel_total_duration_ns);
+  EXPECT_EQ(2u, blocks["/sibling_b/work"].rel_call_count);
+  EXPECT_EQ(40, blocks["/sibling_b/work"].rel_total_duration_ns);
+}
+
+TEST(Profiler, CharArrayLabelsAreNotCached)
+{
+  // Only labels spelled as literals are cached by the call site, so
+  // each name gets its own block.
+  const char names[2][8] = { "array_a", "array_b" };
+  for (int i = 0; i < 4; i++) {
+    SWRI_PROFILE(names[i % 2]);
+  }
+
+  std::map<std::string, sp::SharedMemoryBlock> blocks = collect();
+  ASSERT_EQ(1u, blocks.count("/array_a"));
+  ASSERT_EQ(1u, blocks.count("/array_b"));
+  EXPECT_EQ(2u, blocks["/array_a"].rel_call_count);
+  EXPECT_EQ(2u, blocks["/array_b"].rel_call_count);
+}
+
+TEST(Profiler, SampledCallsAreCounted)
+{
+  for (int i = 0; i < 10; i++) {
+    SWRI_PROFILE_SAMPLED("sampled", 4);
+    sp::Clock::advanceFakeTime(8);
+  }
+
+  // Every call is counted, and the timed calls are scaled up to all
+  // of them.
+  std::map<std::string, sp::SharedMemoryBlock> blocks = collect();
+  ASSERT_EQ(1u, blocks.count("/sampled"));
+  const sp::SharedMemoryBlock &block = blocks["/sampled"];
+  EXPECT_EQ(10u, block.rel_call_count);
+  EXPECT_EQ(2u, block.rel_timed_call_count);
+  EXPECT_EQ(80, block.rel_total_duration_ns);
+}
+
+TEST(Profiler, SampledCallsAreCountedInTheirWindow)
+{
+  // The worker stays alive but idle while we collect, so nothing but
+  // the window it called in can report its calls.  Failures must not
+  // return early, or the worker is never joined.
+  std::mutex mutex;
+  std::condition_variable cv;
+  int step = 0;
+  auto waitFor = [&](int value) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return step >= value; });
+  };
+  auto advance = [&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    step++;
+    cv.notify_all();
+  };
+
+  std::thread worker([&]() {
+    for (int i = 0; i < 10; i++) {
+      SWRI_PROFILE_SAMPLED("windowed", 1000);
+    }
+    advance();
+    waitFor(2);
+    for (int i = 0; i < 5; i++) {
+      SWRI_PROFILE_SAMPLED("windowed", 1000);
+    }
+    advance();
+    waitFor(4);
+  });
+
+  waitFor(1);
+  std::map<std::string, sp::SharedMemoryBlock> blocks = collect();
+  EXPECT_EQ(1u, blocks.count("/windowed"));
+  EXPECT_EQ(10u, blocks["/windowed"].rel_call_count);
+
+  advance();
+  waitFor(3);
+  blocks = collect();
+  EXPECT_EQ(1u, blocks.count("/windowed"));
+  EXPECT_EQ(5u, blocks["/windowed"].rel_call_count);
+  EXPECT_EQ(15u, blocks["/windowed"].abs_call_count);
+
+  advance();
+  worker.join();
+}
+
+TEST(Profiler, BlocksBeyondMaxNodesOverflow)
+{
+  // Every new block overflows, and anything inside an overflow block
+  // is recorded in it.
+  sp::Profiler::setMaxNodes(2);
+  {
+    SWRI_PROFILE("overflow_parent");
+    SWRI_PROFILE("overflow_child");
+    sp::Clock::advanceFakeTime(5);
+  }
+  {
+    SWRI_PROFILE("overflow_other");
+    sp::Clock::advanceFakeTime(5);
+  }
+  sp::Profiler::setMaxNodes(10000);
+
+  std::map<std::string, sp::SharedMemoryBlock> blocks = collect();
+  EXPECT_EQ(0u, blocks.count("/overflow_parent"));
+  EXPECT_EQ(0u, blocks.count("/overflow_parent/overflow_child"));
+  EXPECT_EQ(0u, blocks.count("/overflow_other"));
+  ASSERT_EQ(1u, blocks.count("/overflow"));
+  EXPECT_EQ(3u, blocks["/overflow"].rel_call_count);
+}
+
+TEST(Profiler, EvictionSparesOpenSampledBlocks)
+{
+  // Any block that was idle for a nanosecond is evicted, from the
+  // leaves up, at each collection.
+  sp::Profiler::setIdleEvictionTime(1e-9);
+  auto collectLater = []() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return collect();
+  };
+
+  // The outer block is called once first so that it is reported, and
+  // could be evicted, before the long call.  Neither call is timed.
+  const sp::Label &outer_label = *sp::Profiler::lookupLabel("evict_outer");
+  auto outer = [&outer_label]() { return new sp::Profiler(outer_label, 1000); };
+  delete outer();
+  std::map<std::string, sp::SharedMemoryBlock> blocks = collectLater();
+  ASSERT_EQ(1u, blocks.count("/evict_outer"));
+
+  {
+    std::unique_ptr<sp::Profiler> block(outer());
+    {
+      SWRI_PROFILE("evict_child");
+    }
+    blocks = collectLater();
+    ASSERT_EQ(1u, blocks.count("/evict_outer/evict_child"));
+
+    // The idle child is evicted and its key retired, but the open
+    // block it was called from isn't.
+    for (int i = 0; i < 3; i++) {
+      blocks = collectLater();
+    }
+    EXPECT_EQ(0u, blocks.count("/evict_outer/evict_child"));
+
+    // Calling the child again creates it anew.
+    {
+      SWRI_PROFILE("evict_child");
+    }
+    blocks = collectLater();
+    ASSERT_EQ(1u, blocks.count("/evict_outer/evict_child"));
+    EXPECT_EQ(1u, blocks["/evict_outer/evict_child"].rel_call_count);
+    EXPECT_EQ(1u, blocks["/evict_outer/evict_child"].abs_call_count);
+  }
+
+  blocks = collectLater();
+  ASSERT_EQ(1u, blocks.count("/evict_outer"));
+  EXPECT_EQ(1u, blocks["/evict_outer"].rel_call_count);
+  EXPECT_EQ(0u, blocks["/evict_outer"].rel_timed_call_count);
+  sp::Profiler::setIdleEvictionTime(0.0);
+}
+
+TEST(ProfiledMutex, HoldStartingAtTimeZeroIsRecorded)
+{
+  // Zero is a valid fake time, so it can't be mistaken for an
+  // unprofiled acquisition.
+  const int64_t now = sp::Clock::now();
+  sp::ProfiledMutex<> mutex("zero_mutex");
+  sp::Clock::setFakeTime(0);
+  mutex.lock();
+  sp::Clock::advanceFakeTime(7);
+  mutex.unlock();
+  sp::Clock::setFakeTime(now);
+
+  std::map<std::string, sp::SharedMemoryBlock> blocks = collect();
+  ASSERT_EQ(1u, blocks.count("/zero_mutex.hold"));
+  EXPECT_EQ(1u, blocks["/zero_mutex.hold"].rel_call_count);
+  EXPECT_EQ(7, blocks["/zero_mutex.hold"].rel_total_duration_ns);
+  EXPECT_EQ(0u, blocks.count("/zero_mutex.wait"));
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+
+  // The fake clock only moves when a test advances it, so every
+  // duration is exact.
+  sp::Clock::setSource(sp::Clock::FAKE);
+  sp::Clock::setFakeTime(1000000000);
+  sp::Profiler::initializeStandalone();
+  if (!sp::Profiler::setSharedMemoryExport(true)) {
+    return 1;
+  }
+  return RUN_ALL_TESTS();
+}
@@ -49,6 +49,25 @@ struct NewProfileData
   uint64_t cumulative_inclusive_duration_ns;
   uint64_t incremental_inclusive_duration_ns;
   uint64_t incremental_max_duration_ns;
+  uint64_t incremental_p50_duration_ns;
+  uint64_t incremental_p90_duration_ns;
+  uint64_t incremental_p99_duration_ns;
+  uint64_t incremental_p999_duration_ns;
+  // The estimated time spent in the profiler itself that is included
+  // in the incremental inclusive duration.
+  uint64_t incremental_overhead_duration_ns;
+  uint64_t incremental_alloc_count;
+  uint64_t incremental_alloc_bytes;
+  // The CPU time used in the increment, including nested blocks.
+  // Zero if the node doesn't measure CPU time.
+  uint64_t incremental_cpu_duration_ns;
+  // The items and bytes the block reported processing in the
+  // increment.  Zero if the block doesn't report its work.
+  uint64_t incremental_items;
+  uint64_t incremental_bytes;
+  // True if only some of the calls in this increment were timed, so
+  // the incremental durations are estimates.
+  bool sampled;
 };  // struct NewProfileData
 
 typedef std::vector<NewProfileData> NewProfileDataVector;
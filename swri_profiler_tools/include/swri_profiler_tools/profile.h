@@ -56,6 +56,13 @@ class ProfileEntry
   // to data in measured nodes.
   
   bool projected;
+
+  // sampled indicates that the profiler only timed some of the calls
+  // in this increment and scaled the durations up, so the timing
+  // data is an estimate.  Inferred nodes are sampled if any of their
+  // children are.
+  bool sampled;
+
   uint64_t cumulative_call_count;
   uint64_t cumulative_inclusive_duration_ns;
   uint64_t incremental_inclusive_duration_ns;
@@ -63,15 +70,68 @@ class ProfileEntry
   uint64_t incremental_exclusive_duration_ns;
   uint64_t incremental_max_duration_ns;
 
+  // Percentiles of the call durations in the increment.  These are
+  // only available for measured nodes and are zero otherwise.
+  uint64_t incremental_p50_duration_ns;
+  uint64_t incremental_p90_duration_ns;
+  uint64_t incremental_p99_duration_ns;
+  uint64_t incremental_p999_duration_ns;
+
+  // The estimated time spent in the profiler itself that is included
+  // in the incremental inclusive duration.  Inferred nodes report the
+  // sum of their children's overhead.
+  uint64_t incremental_overhead_duration_ns;
+
+  // Heap allocations made in the increment, including nested blocks.
+  // These are only reported by nodes that count allocations.
+  uint64_t incremental_alloc_count;
+  uint64_t incremental_alloc_bytes;
+
+  // The CPU time used in the increment, including and excluding
+  // nested blocks, and the rest of the inclusive duration, which was
+  // spent blocked or preempted.  These are zero if the node doesn't
+  // measure CPU time.  Inferred nodes use the sum of their children's
+  // CPU time.
+  uint64_t incremental_cpu_duration_ns;
+  uint64_t incremental_exclusive_cpu_duration_ns;
+  uint64_t incremental_off_cpu_duration_ns;
+
+  // The items and bytes processed in the increment, as reported by
+  // the block with SWRI_PROFILE_ITEMS and SWRI_PROFILE_BYTES.  Since
+  // each entry covers one second, these are also the items and bytes
+  // per second.  The time per item is derived from the inclusive
+  // duration, and is zero if no items were reported.  Inferred nodes
+  // don't report work, since their children's items may not be
+  // comparable.
+  uint64_t incremental_items;
+  uint64_t incremental_bytes;
+  double incremental_ns_per_item;
+  double incremental_ns_per_byte;
+
   ProfileEntry()
     :
     projected(false),
+    sampled(false),
     cumulative_call_count(0),
     cumulative_inclusive_duration_ns(0),
     incremental_inclusive_duration_ns(0),
     cumulative_exclusive_duration_ns(0),
     incremental_exclusive_duration_ns(0),
-    incremental_max_duration_ns(0)
+    incremental_max_duration_ns(0),
+    incremental_p50_duration_ns(0),
+    incremental_p90_duration_ns(0),
+    incremental_p99_duration_ns(0),
+    incremental_p999_duration_ns(0),
+    incremental_overhead_duration_ns(0),
+    incremental_alloc_count(0),
+    incremental_alloc_bytes(0),
+    incremental_cpu_duration_ns(0),
+    incremental_exclusive_cpu_duration_ns(0),
+    incremental_off_cpu_duration_ns(0),
+    incremental_items(0),
+    incremental_bytes(0),
+    incremental_ns_per_item(0.0),
+    incremental_ns_per_byte(0.0)
   {}
 };  // class ProfileEntry
 
@@ -45,6 +45,27 @@ class ProfilerMsgAdapter
   // full label.
   std::map<QString, std::map<int, QString> > index_;
 
+  // The viewer stores data at one second resolution, so profilers
+  // that report more often have their windows combined.  This stores,
+  // for each node, the data accumulated so far for the current second
+  // of each profile key.
+  std::map<QString, std::map<int, NewProfileData> > partial_seconds_;
+
+  // Profilers may only send the blocks that changed between
+  // keyframes.  This stores, for each node, the last data received
+  // for every block so that the omitted blocks can be filled in, and
+  // the sequence number of the next window.  Until a keyframe is
+  // received, or after a window is lost, the stream is not synced and
+  // windows that aren't keyframes are dropped.
+  struct StreamState
+  {
+    bool synced;
+    uint64_t next_sequence;
+    std::map<int, NewProfileData> last_data;
+    StreamState() : synced(false), next_sequence(0) {}
+  };
+  std::map<QString, StreamState> streams_;
+
  public:
   ProfilerMsgAdapter();
   ~ProfilerMsgAdapter();
@@ -52,6 +73,12 @@ class ProfilerMsgAdapter
   void processIndex(const swri_profiler_msgs::ProfileIndexArray &msg);
   bool processData(NewProfileDataVector &out_data, const swri_profiler_msgs::ProfileDataArray &msg);
   void reset();
+
+ private:
+  void accumulateWindow(NewProfileData &data, NewProfileData &partial);
+  // Drops the data for keys that aren't in the node's index.
+  void pruneRetiredKeys(std::map<int, NewProfileData> &data,
+                        const std::map<int, QString> &index);
 };  // class ProfilerMsgAdapter
 }  // namespace swri_profiler_tools
 #endif  // SWRI_PROFILER_TOOLS_PROFILER_MSG_ADAPTER_H_
@@ -35,6 +35,7 @@
 #include <ros/subscriber.h>
 #include <swri_profiler_msgs/ProfileIndexArray.h>
 #include <swri_profiler_msgs/ProfileDataArray.h>
+#include <swri_profiler_msgs/ProfileDataBatch.h>
 
 namespace swri_profiler_tools
 {
@@ -44,6 +45,7 @@ class RosSourceBackend : public QObject
 
   ros::Subscriber index_sub_;
   ros::Subscriber data_sub_;  
+  ros::Subscriber data_batch_sub_;
 
   bool is_connected_;  
   
@@ -64,6 +66,7 @@ class RosSourceBackend : public QObject
 
   void handleIndex(const swri_profiler_msgs::ProfileIndexArray &msg);
   void handleData(const swri_profiler_msgs::ProfileDataArray &msg);
+  void handleDataBatch(const swri_profiler_msgs::ProfileDataBatch &msg);
 };  // class RosSourceBackend
 }  // namespace swri_profiler_tools
 #endif  // SWRI_PROFILER_TOOLS_ROS_SOURCE_BACKEND_H_
@@ -260,6 +260,17 @@ void Profile::storeItemData(std::set<uint64_t> &modified_times,
   node.data_[index].cumulative_inclusive_duration_ns = item.cumulative_inclusive_duration_ns;
   node.data_[index].incremental_inclusive_duration_ns = item.incremental_inclusive_duration_ns;
   node.data_[index].incremental_max_duration_ns = item.incremental_max_duration_ns;
+  node.data_[index].incremental_p50_duration_ns = item.incremental_p50_duration_ns;
+  node.data_[index].incremental_p90_duration_ns = item.incremental_p90_duration_ns;
+  node.data_[index].incremental_p99_duration_ns = item.incremental_p99_duration_ns;
+  node.data_[index].incremental_p999_duration_ns = item.incremental_p999_duration_ns;
+  node.data_[index].incremental_overhead_duration_ns = item.incremental_overhead_duration_ns;
+  node.data_[index].incremental_alloc_count = item.incremental_alloc_count;
+  node.data_[index].incremental_alloc_bytes = item.incremental_alloc_bytes;
+  node.data_[index].incremental_cpu_duration_ns = item.incremental_cpu_duration_ns;
+  node.data_[index].incremental_items = item.incremental_items;
+  node.data_[index].incremental_bytes = item.incremental_bytes;
+  node.data_[index].sampled = item.sampled;
   // Exclusive timing fields are derived data and are set in updateDerivedData().
 
   // If the subsequent elements are projected data, we should
@@ -383,6 +394,11 @@ void Profile::updateDerivedDataInternal(ProfileNode &node, size_t index)
   uint64_t children_cum_incl_duration = 0;
   uint64_t children_inc_incl_duration = 0;
   uint64_t children_inc_max_duration = 0;
+  uint64_t children_inc_overhead_duration = 0;
+  uint64_t children_inc_alloc_count = 0;
+  uint64_t children_inc_alloc_bytes = 0;
+  uint64_t children_inc_cpu_duration = 0;
+  bool children_sampled = false;
 
   for (auto &child_key : node.childKeys()) {
     if (nodes_.count(child_key) == 0) {
@@ -397,6 +413,11 @@ void Profile::updateDerivedDataInternal(ProfileNode &node, size_t index)
     children_cum_incl_duration += data.cumulative_inclusive_duration_ns;
     children_inc_incl_duration += data.incremental_inclusive_duration_ns;
     children_inc_max_duration = std::max(children_inc_max_duration, data.incremental_max_duration_ns);
+    children_inc_overhead_duration += data.incremental_overhead_duration_ns;
+    children_inc_alloc_count += data.incremental_alloc_count;
+    children_inc_alloc_bytes += data.incremental_alloc_bytes;
+    children_inc_cpu_duration += data.incremental_cpu_duration_ns;
+    children_sampled |= data.sampled;
   }
 
   ProfileEntry &data = node.data_[index];
@@ -405,6 +426,11 @@ void Profile::updateDerivedDataInternal(ProfileNode &node, size_t index)
     data.cumulative_inclusive_duration_ns = children_cum_incl_duration;
     data.incremental_inclusive_duration_ns = children_inc_incl_duration;
     data.incremental_max_duration_ns = children_inc_max_duration;
+    data.incremental_overhead_duration_ns = children_inc_overhead_duration;
+    data.incremental_alloc_count = children_inc_alloc_count;
+    data.incremental_alloc_bytes = children_inc_alloc_bytes;
+    data.incremental_cpu_duration_ns = children_inc_cpu_duration;
+    data.sampled = children_sampled;
   }
 
   if (children_cum_incl_duration > data.cumulative_inclusive_duration_ns) {
@@ -446,6 +472,31 @@ void Profile::updateDerivedDataInternal(ProfileNode &node, size_t index)
   } else {    
     data.incremental_exclusive_duration_ns = data.incremental_inclusive_duration_ns - children_inc_incl_duration;
   }
+
+  // CPU time is measured independently of wall time and may be
+  // sampled, so we clamp rather than warn when it doesn't add up.
+  if (data.incremental_cpu_duration_ns == 0) {
+    data.incremental_exclusive_cpu_duration_ns = 0;
+    data.incremental_off_cpu_duration_ns = 0;
+  } else {
+    data.incremental_exclusive_cpu_duration_ns =
+      data.incremental_cpu_duration_ns - std::min(data.incremental_cpu_duration_ns,
+                                                  children_inc_cpu_duration);
+    data.incremental_off_cpu_duration_ns =
+      data.incremental_inclusive_duration_ns - std::min(data.incremental_inclusive_duration_ns,
+                                                        data.incremental_cpu_duration_ns);
+  }
+
+  data.incremental_ns_per_item = 0.0;
+  if (data.incremental_items > 0) {
+    data.incremental_ns_per_item =
+      static_cast<double>(data.incremental_inclusive_duration_ns) / data.incremental_items;
+  }
+  data.incremental_ns_per_byte = 0.0;
+  if (data.incremental_bytes > 0) {
+    data.incremental_ns_per_byte =
+      static_cast<double>(data.incremental_inclusive_duration_ns) / data.incremental_bytes;
+  }
 }
 
 void Profile::setName(const QString &name)
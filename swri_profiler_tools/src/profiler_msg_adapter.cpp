@@ -1,4 +1,9 @@
 #include <swri_profiler_tools/profiler_msg_adapter.h>
+
+#include <algorithm>
+#include <cmath>
+#include <set>
+
 #include <swri_profiler_tools/util.h>
 
 namespace swri_profiler_tools
@@ -18,7 +23,9 @@ void ProfilerMsgAdapter::processIndex(const swri_profiler_msgs::ProfileIndexArra
 
   // An index message contains the entire index table for the message,
   // so we wipe out any existing index to make sure we are completely
-  // in sync.
+  // in sync.  The partial seconds are kept, since the index is
+  // republished whenever blocks are added and the keys in it don't
+  // change meaning.
   index_[ros_node_name].clear();
   
   for (auto const &item : msg.data) {
@@ -40,6 +47,23 @@ void ProfilerMsgAdapter::processIndex(const swri_profiler_msgs::ProfileIndexArra
     
     index_[ros_node_name][item.key] = label;
   }
+
+  // Keys that were left out of the index have been retired by the
+  // profiler and will never be sent again.
+  pruneRetiredKeys(streams_[ros_node_name].last_data, index_[ros_node_name]);
+  pruneRetiredKeys(partial_seconds_[ros_node_name], index_[ros_node_name]);
+}
+
+void ProfilerMsgAdapter::pruneRetiredKeys(std::map<int, NewProfileData> &data,
+                                          const std::map<int, QString> &index)
+{
+  for (auto it = data.begin(); it != data.end(); ) {
+    if (index.count(it->first)) {
+      ++it;
+    } else {
+      it = data.erase(it);
+    }
+  }
 }
 
 bool ProfilerMsgAdapter::processData(
@@ -53,7 +77,35 @@ bool ProfilerMsgAdapter::processData(
     return false;
   }
 
-  int timestamp_sec = std::round(msg.header.stamp.toSec());
+  // Each window is assigned to the second that contains most of it.
+  // For the default one second period aligned to whole seconds this
+  // is simply the stamp.  Profilers that don't report their period
+  // publish once a second.
+  const double period = msg.period.toSec();
+  int timestamp_sec;
+  if (period > 0.0) {
+    timestamp_sec = std::ceil(msg.header.stamp.toSec() - period / 2.0);
+  } else {
+    timestamp_sec = std::round(msg.header.stamp.toSec());
+  }
+
+  StreamState &stream = streams_[node_name];
+  if (!msg.keyframe && (!stream.synced || msg.sequence != stream.next_sequence)) {
+    if (stream.synced) {
+      qWarning("Lost profiler data from %s (expected window %llu but got %llu). "
+               "Waiting for a keyframe.",
+               qPrintable(node_name),
+               static_cast<unsigned long long>(stream.next_sequence),
+               static_cast<unsigned long long>(msg.sequence));
+      stream.synced = false;
+    }
+    return false;
+  }
+
+  std::map<int, NewProfileData> last_data;
+  if (!msg.keyframe) {
+    last_data = stream.last_data;
+  }
 
   NewProfileDataVector out;
   out.reserve(msg.data.size());
@@ -73,14 +125,110 @@ bool ProfilerMsgAdapter::processData(
     out.back().cumulative_inclusive_duration_ns = item.abs_total_duration.toNSec();
     out.back().incremental_inclusive_duration_ns = item.rel_total_duration.toNSec();
     out.back().incremental_max_duration_ns = item.rel_max_duration.toNSec();
+    out.back().incremental_p50_duration_ns = item.rel_p50_duration.toNSec();
+    out.back().incremental_p90_duration_ns = item.rel_p90_duration.toNSec();
+    out.back().incremental_p99_duration_ns = item.rel_p99_duration.toNSec();
+    out.back().incremental_p999_duration_ns = item.rel_p999_duration.toNSec();
+    out.back().incremental_overhead_duration_ns = item.rel_overhead_duration.toNSec();
+    out.back().incremental_alloc_count = item.rel_alloc_count;
+    out.back().incremental_alloc_bytes = item.rel_alloc_bytes;
+    out.back().incremental_cpu_duration_ns = item.rel_cpu_duration.toNSec();
+    out.back().incremental_items = item.rel_items;
+    out.back().incremental_bytes = item.rel_bytes;
+    out.back().sampled = item.rel_timed_call_count < item.rel_call_count;
+    last_data[item.key] = out.back();
+
+    if (period > 0.0 && period < 1.0) {
+      accumulateWindow(out.back(), partial_seconds_[node_name][item.key]);
+    }
+  }
+
+  // Blocks that were left out of a delta window weren't called, so
+  // their cumulative data carries over and their incremental data is
+  // zero.
+  if (!msg.keyframe) {
+    std::set<int> sent;
+    for (auto const &item : msg.data) {
+      sent.insert(item.key);
+    }
+    for (auto const &pair : last_data) {
+      if (sent.count(pair.first) || index_[node_name].count(pair.first) == 0) {
+        continue;
+      }
+      out.emplace_back(pair.second);
+      NewProfileData &data = out.back();
+      data.wall_stamp_sec = timestamp_sec;
+      data.ros_stamp_ns = msg.rostime_stamp.toNSec();
+      data.incremental_inclusive_duration_ns = 0;
+      data.incremental_max_duration_ns = 0;
+      data.incremental_p50_duration_ns = 0;
+      data.incremental_p90_duration_ns = 0;
+      data.incremental_p99_duration_ns = 0;
+      data.incremental_p999_duration_ns = 0;
+      data.incremental_overhead_duration_ns = 0;
+      data.incremental_alloc_count = 0;
+      data.incremental_alloc_bytes = 0;
+      data.incremental_cpu_duration_ns = 0;
+      data.incremental_items = 0;
+      data.incremental_bytes = 0;
+      data.sampled = false;
+      last_data[pair.first] = data;
+
+      if (period > 0.0 && period < 1.0) {
+        accumulateWindow(data, partial_seconds_[node_name][pair.first]);
+      }
+    }
   }
 
+  stream.synced = true;
+  stream.next_sequence = msg.sequence + 1;
+  stream.last_data.swap(last_data);
+
   out_data.insert(out_data.end(), out.begin(), out.end());
   return true;
 }
 
+void ProfilerMsgAdapter::accumulateWindow(NewProfileData &data, NewProfileData &partial)
+{
+  if (partial.label != data.label || partial.wall_stamp_sec != data.wall_stamp_sec) {
+    // This is the first window of a new second.
+    partial = data;
+    return;
+  }
+
+  // Cumulative fields are already up to date.  Durations add up
+  // across the windows and the maximum is the largest of them.  We
+  // can't recover the percentiles of the whole second from the
+  // percentiles of its windows, so we report the largest of them,
+  // which is an upper bound.
+  partial.ros_stamp_ns = data.ros_stamp_ns;
+  partial.cumulative_call_count = data.cumulative_call_count;
+  partial.cumulative_inclusive_duration_ns = data.cumulative_inclusive_duration_ns;
+  partial.incremental_inclusive_duration_ns += data.incremental_inclusive_duration_ns;
+  partial.incremental_overhead_duration_ns += data.incremental_overhead_duration_ns;
+  partial.incremental_alloc_count += data.incremental_alloc_count;
+  partial.incremental_alloc_bytes += data.incremental_alloc_bytes;
+  partial.incremental_cpu_duration_ns += data.incremental_cpu_duration_ns;
+  partial.incremental_items += data.incremental_items;
+  partial.incremental_bytes += data.incremental_bytes;
+  partial.incremental_max_duration_ns = std::max(
+    partial.incremental_max_duration_ns, data.incremental_max_duration_ns);
+  partial.incremental_p50_duration_ns = std::max(
+    partial.incremental_p50_duration_ns, data.incremental_p50_duration_ns);
+  partial.incremental_p90_duration_ns = std::max(
+    partial.incremental_p90_duration_ns, data.incremental_p90_duration_ns);
+  partial.incremental_p99_duration_ns = std::max(
+    partial.incremental_p99_duration_ns, data.incremental_p99_duration_ns);
+  partial.incremental_p999_duration_ns = std::max(
+    partial.incremental_p999_duration_ns, data.incremental_p999_duration_ns);
+  partial.sampled |= data.sampled;
+  data = partial;
+}
+
 void ProfilerMsgAdapter::reset()
 {
   index_.clear();
+  partial_seconds_.clear();
+  streams_.clear();
 }
 };  // namespace swri_profiler_tools
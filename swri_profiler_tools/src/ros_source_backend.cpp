@@ -64,6 +64,7 @@ void RosSourceBackend::startRos()
   ros::NodeHandle nh;
   index_sub_ = nh.subscribe("/profiler/index", 1000, &RosSourceBackend::handleIndex, this);
   data_sub_ = nh.subscribe("/profiler/data", 1000, &RosSourceBackend::handleData, this);
+  data_batch_sub_ = nh.subscribe("/profiler/data_batch", 100, &RosSourceBackend::handleDataBatch, this);
 
   std::string uri = ros::master::getURI();
   Q_EMIT connected(true, QString::fromStdString(uri));
@@ -99,4 +100,13 @@ void RosSourceBackend::handleData(const swri_profiler_msgs::ProfileDataArray &ms
   Q_EMIT dataReceived(msg);
 }
 
+void RosSourceBackend::handleDataBatch(const swri_profiler_msgs::ProfileDataBatch &msg)
+{
+  // Batches are unpacked here so the rest of the viewer only has to
+  // deal with individual windows.
+  for (auto const &window : msg.windows) {
+    Q_EMIT dataReceived(window);
+  }
+}
+
 }  // namespace swri_profiler_tools